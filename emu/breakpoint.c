@@ -0,0 +1,492 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4: */
+/* breakpoint.c -- conditional breakpoints and tracepoints
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "emu6809.h"
+
+/*
+ * A breakpoint is attached to an address and may carry a condition, a hit
+ * count and an action. The condition is compiled once, when the breakpoint
+ * is set, into a small stack bytecode evaluated against the registers and
+ * memory, so that even a breakpoint sitting in a hot loop costs only a few
+ * table lookups per hit. bpmap[] tells the execution loop in one load
+ * whether the new PC has any breakpoint at all.
+ *
+ * Syntax of the condition (numbers are decimal, or hex with $ or 0x):
+ *   registers  A B D X Y U S PC DP CC
+ *   memory     [expr] is the byte at expr, {expr} the word at expr
+ *   operators  ! ~ - (unary), + -, < <= > >=, == !=, &, ^, |, &&, ||
+ * Ex: b 1234 if X > $4000 && [S+2] == $12
+ *     b 1234 count 1000
+ *     b F81A log if A == 13
+ */
+
+// bytecode
+#define BC_END   0
+#define BC_CONST 1		// followed by 16 bits value
+#define BC_REG   2		// followed by register number
+#define BC_MEMB  3
+#define BC_MEMW  4
+#define BC_NOT   5
+#define BC_COM   6
+#define BC_NEG   7
+#define BC_ADD   8
+#define BC_SUB   9
+#define BC_AND   10
+#define BC_OR    11
+#define BC_XOR   12
+#define BC_EQ    13
+#define BC_NE    14
+#define BC_LT    15
+#define BC_LE    16
+#define BC_GT    17
+#define BC_GE    18
+#define BC_JZ    19		// followed by 8 bits offset, keeps 0 on stack if jumping
+#define BC_JNZ   20		// followed by 8 bits offset, keeps 1 on stack if jumping
+#define BC_BOOL  21
+
+#define BC_MAXCODE 128
+#define BC_MAXSTACK 16
+
+// registers as seen by BC_REG
+#define R_A 0
+#define R_B 1
+#define R_D 2
+#define R_X 3
+#define R_Y 4
+#define R_U 5
+#define R_S 6
+#define R_PC 7
+#define R_DP 8
+#define R_CC 9
+
+static const char *regname[] = { "A", "B", "D", "X", "Y", "U", "S", "PC", "DP", "CC" };
+
+#define BP_STOP 0
+#define BP_LOG 1
+
+struct Breakpoint {
+	int id;
+	uint16_t addr;
+	int action;
+	long count;		// number of hits before triggering (0 = first one)
+	long hits;
+	uint8_t *code;	// NULL if unconditional
+	char text[80];
+	struct Breakpoint *next;
+};
+
+uint8_t bpmap[0x10000];	// number of breakpoints at each address
+
+static struct Breakpoint *breakpoints = NULL;
+static int bp_lastid = 0;
+
+// compiler state
+static char *src;
+static uint8_t code[BC_MAXCODE];
+static int pc, depth, maxdepth, bc_error;
+
+static void emit( uint8_t b) {
+  if (pc < BC_MAXCODE)
+	code[pc++] = b;
+  else
+	bc_error = 1;
+}
+
+static void push( int n) {
+  depth += n;
+  if (depth > maxdepth)
+	maxdepth = depth;
+}
+
+static int token( char *tok) {
+  int n = strlen( tok);
+
+  ignore_ws( &src);
+  if (strncmp( src, tok, n) != 0)
+	return 0;
+  src += n;
+  return 1;
+}
+
+static void expr_or(void);
+
+static void primary(void) {
+  long val;
+  char *end;
+  int i, n;
+
+  ignore_ws( &src);
+  if (token( "(")) {
+	expr_or();
+	if (!token( ")"))
+	  bc_error = 1;
+	return;
+  }
+  if (token( "[")) {
+	expr_or();
+	if (!token( "]"))
+	  bc_error = 1;
+	emit( BC_MEMB);
+	return;
+  }
+  if (token( "{")) {
+	expr_or();
+	if (!token( "}"))
+	  bc_error = 1;
+	emit( BC_MEMW);
+	return;
+  }
+  if (*src == '$' || (src[0] == '0' && toupper( src[1]) == 'X')) {
+	src += (*src == '$') ? 1 : 2;
+	val = strtol( src, &end, 16);
+  } else if (isdigit( *src))
+	val = strtol( src, &end, 10);
+  else {
+	for (i = 9; i >= 0; i--) {	// longest names first
+	  n = strlen( regname[i]);
+	  if (strncasecmp( src, regname[i], n) == 0 && !isalnum( src[n])) {
+		src += n;
+		emit( BC_REG);
+		emit( i);
+		push( 1);
+		return;
+	  }
+	}
+	bc_error = 1;
+	return;
+  }
+  if (end == src)
+	bc_error = 1;
+  src = end;
+  emit( BC_CONST);
+  emit( (val >> 8) & 0xff);
+  emit( val & 0xff);
+  push( 1);
+}
+
+static void unary(void) {
+  ignore_ws( &src);
+  if (*src == '!' && src[1] != '=') {
+	src++;
+	unary();
+	emit( BC_NOT);
+  } else if (token( "~")) {
+	unary();
+	emit( BC_COM);
+  } else if (token( "-")) {
+	unary();
+	emit( BC_NEG);
+  } else
+	primary();
+}
+
+static void additive(void) {
+  unary();
+  for (;;) {
+	if (token( "+")) {
+	  unary(); emit( BC_ADD);
+	} else if (token( "-")) {
+	  unary(); emit( BC_SUB);
+	} else
+	  return;
+	push( -1);
+  }
+}
+
+static void relational(void) {
+  additive();
+  for (;;) {
+	if (token( "<=")) {
+	  additive(); emit( BC_LE);
+	} else if (token( ">=")) {
+	  additive(); emit( BC_GE);
+	} else if (token( "<")) {
+	  additive(); emit( BC_LT);
+	} else if (token( ">")) {
+	  additive(); emit( BC_GT);
+	} else
+	  return;
+	push( -1);
+  }
+}
+
+static void equality(void) {
+  relational();
+  for (;;) {
+	if (token( "==")) {
+	  relational(); emit( BC_EQ);
+	} else if (token( "!=")) {
+	  relational(); emit( BC_NE);
+	} else
+	  return;
+	push( -1);
+  }
+}
+
+static void bitand(void) {
+  equality();
+  for (;;) {
+	ignore_ws( &src);
+	if (src[0] != '&' || src[1] == '&')
+	  return;
+	src++;
+	equality();
+	emit( BC_AND);
+	push( -1);
+  }
+}
+
+static void bitxor(void) {
+  bitand();
+  while (token( "^")) {
+	bitand();
+	emit( BC_XOR);
+	push( -1);
+  }
+}
+
+static void bitor(void) {
+  bitxor();
+  for (;;) {
+	ignore_ws( &src);
+	if (src[0] != '|' || src[1] == '|')
+	  return;
+	src++;
+	bitxor();
+	emit( BC_OR);
+	push( -1);
+  }
+}
+
+// && and || are short-circuited so that memory is not read for nothing
+static void expr_and(void) {
+  int fix;
+
+  bitor();
+  while (token( "&&")) {
+	emit( BC_JZ);
+	fix = pc;
+	emit( 0);
+	push( -1);
+	bitor();
+	emit( BC_BOOL);
+	if (fix < BC_MAXCODE)	// else the code is already too long
+	  code[fix] = pc - fix - 1;
+  }
+}
+
+static void expr_or(void) {
+  int fix;
+
+  expr_and();
+  while (token( "||")) {
+	emit( BC_JNZ);
+	fix = pc;
+	emit( 0);
+	push( -1);
+	expr_and();
+	emit( BC_BOOL);
+	if (fix < BC_MAXCODE)	// else the code is already too long
+	  code[fix] = pc - fix - 1;
+  }
+}
+
+static uint8_t *break_compile( char *cond) {
+  uint8_t *bc;
+
+  src = cond;
+  pc = depth = maxdepth = bc_error = 0;
+  expr_or();
+  emit( BC_END);
+  if (more_params( &src) || maxdepth > BC_MAXSTACK)
+	bc_error = 1;
+  if (bc_error)
+	return NULL;
+  bc = mmalloc( pc);
+  memcpy( bc, code, pc);
+  return bc;
+}
+
+static int break_eval( uint8_t *ip) {
+  int32_t stack[BC_MAXSTACK + 1];
+  int32_t *sp = stack;	// sp points to the top value
+
+  for (;;) {
+	switch (*ip++) {
+	  case BC_END: return *sp != 0;
+	  case BC_CONST: *++sp = (ip[0] << 8) | ip[1]; ip += 2; break;
+	  case BC_REG:
+		switch (*ip++) {
+		  case R_A: *++sp = ra; break;
+		  case R_B: *++sp = rb; break;
+		  case R_D: *++sp = (ra << 8) | rb; break;
+		  case R_X: *++sp = rx; break;
+		  case R_Y: *++sp = ry; break;
+		  case R_U: *++sp = ru; break;
+		  case R_S: *++sp = rs; break;
+		  case R_PC: *++sp = rpc; break;
+		  case R_DP: *++sp = rdp; break;
+		  case R_CC: *++sp = getcc(); break;
+		}
+		break;
+	  case BC_MEMB: *sp = get_memb( (uint16_t)*sp); break;
+	  case BC_MEMW: *sp = get_memw( (uint16_t)*sp); break;
+	  case BC_NOT: *sp = !*sp; break;
+	  case BC_COM: *sp = ~*sp & 0xffff; break;
+	  case BC_NEG: *sp = -*sp; break;
+	  case BC_ADD: sp--; *sp += sp[1]; break;
+	  case BC_SUB: sp--; *sp -= sp[1]; break;
+	  case BC_AND: sp--; *sp &= sp[1]; break;
+	  case BC_OR:  sp--; *sp |= sp[1]; break;
+	  case BC_XOR: sp--; *sp ^= sp[1]; break;
+	  case BC_EQ:  sp--; *sp = *sp == sp[1]; break;
+	  case BC_NE:  sp--; *sp = *sp != sp[1]; break;
+	  case BC_LT:  sp--; *sp = *sp < sp[1]; break;
+	  case BC_LE:  sp--; *sp = *sp <= sp[1]; break;
+	  case BC_GT:  sp--; *sp = *sp > sp[1]; break;
+	  case BC_GE:  sp--; *sp = *sp >= sp[1]; break;
+	  case BC_JZ:
+		if (*sp == 0)
+		  ip += *ip;
+		else
+		  sp--;
+		ip++;
+		break;
+	  case BC_JNZ:
+		if (*sp != 0) {
+		  *sp = 1;
+		  ip += *ip;
+		} else
+		  sp--;
+		ip++;
+		break;
+	  case BC_BOOL: *sp = *sp != 0; break;
+	}
+  }
+}
+
+// b adr [count n] [log] [if cond]
+int break_set( char *args) {
+  struct Breakpoint *bp;
+  char *kw;
+
+  bp = mmalloc( sizeof( struct Breakpoint));
+  bp->addr = readhex( &args);
+  bp->action = BP_STOP;
+  bp->count = 0;
+  bp->hits = 0;
+  bp->code = NULL;
+  bp->text[0] = '\0';
+
+  while (more_params( &args)) {
+	kw = readstr( &args);
+	if (strcmp( kw, "count") == 0)
+	  bp->count = readint( &args);
+	else if (strcmp( kw, "log") == 0)
+	  bp->action = BP_LOG;
+	else if (strcmp( kw, "if") == 0) {
+	  ignore_ws( &args);
+	  if (strcspn( args, "\n") >= sizeof( bp->text)) {
+		printf( "Condition longer than %d characters\n", (int)sizeof( bp->text) - 1);
+		free( bp);
+		return 0;
+	  }
+	  strncpy( bp->text, args, sizeof( bp->text) - 1);
+	  bp->text[sizeof( bp->text) - 1] = '\0';
+	  bp->text[strcspn( bp->text, "\n")] = '\0';
+	  if ((bp->code = break_compile( bp->text)) == NULL) {
+		printf( "Invalid condition '%s'\n", bp->text);
+		free( bp);
+		return 0;
+	  }
+	  break;
+	} else {
+	  printf( "Unknown breakpoint option '%s'\n", kw);
+	  free( bp);
+	  return 0;
+	}
+  }
+
+  bp->id = ++bp_lastid;
+  bp->next = breakpoints;
+  breakpoints = bp;
+  bpmap[bp->addr]++;
+  return bp->id;
+}
+
+void break_clear( int id) {
+  struct Breakpoint **pbp, *bp;
+
+  pbp = &breakpoints;
+  while ((bp = *pbp) != NULL) {
+	if (id == 0 || bp->id == id) {
+	  *pbp = bp->next;
+	  bpmap[bp->addr]--;
+	  free( bp->code);
+	  free( bp);
+	} else
+	  pbp = &bp->next;
+  }
+}
+
+void break_list(void) {
+  struct Breakpoint *bp;
+
+  if (breakpoints == NULL)
+	printf( "No breakpoint\n");
+  for (bp = breakpoints; bp != NULL; bp = bp->next) {
+	printf( "%2d: %04X %s hits=%ld", bp->id, bp->addr,
+		bp->action == BP_LOG ? "log " : "stop", bp->hits);
+	if (bp->count)
+	  printf( " count=%ld", bp->count);
+	if (bp->code)
+	  printf( " if %s", bp->text);
+	putchar( '\n');
+  }
+}
+
+// Called when bpmap[adr] is set : returns 1 if the console must be entered
+int break_check( uint16_t adr) {
+  struct Breakpoint *bp;
+  int stop = 0;
+
+  for (bp = breakpoints; bp != NULL; bp = bp->next) {
+	if (bp->addr != adr)
+	  continue;
+	if (bp->code != NULL && !break_eval( bp->code))
+	  continue;
+	if (++bp->hits < bp->count)
+	  continue;
+	if (bp->action == BP_LOG)
+	  printf( "trace %d @%04X: A=%02X B=%02X X=%04X Y=%04X U=%04X S=%04X DP=%02X CC=%s\n",
+		  bp->id, adr, ra, rb, rx, ry, ru, rs, rdp, ccstr( getcc()));
+	else {
+	  printf( "Breakpoint %d at %04X\n", bp->id, adr);
+	  stop = 1;
+	}
+  }
+  return stop;
+}
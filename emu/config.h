@@ -36,3 +36,13 @@
  * define to compute CC V bit only when required
  */
 #define BIT_V_DELAYED
+
+/*
+ * size limit of physical memory, for S2/S3 records and banked memory
+ */
+#define PHYS_MAX 0x1000000
+
+/*
+ * cpu clock in Hz, for the time taken by devices
+ */
+#define CPU_CLOCK 1000000
@@ -114,7 +114,11 @@ int execute()
 	while ((n = m6809_execute()) > 0 && !activate_console) {
 	  cycles += n;
 	  device_run();
-
+	  if (bpmap[rpc] && break_check(rpc)) {
+		activate_console = 1;
+		n = 0;
+		break;
+	  }
 	}
 	if (activate_console && n > 0) {
 	  cycles += n;
@@ -142,6 +146,10 @@ void execute_addr(uint16_t addr)
 	while ((n = m6809_execute()) > 0 && !activate_console && rpc != addr) {
 	  cycles += n;
 	  device_run();
+	  if (bpmap[rpc] && break_check(rpc)) {
+		activate_console = 1;
+		break;
+	  }
 	}
 	if (n == SYSTEM_CALL)
 	  activate_console = m6809_system();
@@ -222,6 +230,14 @@ char next_char(char **c)
   return *(*c)++;
 } 
   
+// Motorola S-records, with 16, 24 or 32 bits addresses
+static int srec_ext( char *name) {
+  char *ext = strchr( name, '.');
+
+  return ext != NULL && (strncmp( ext, ".s19", 4) == 0
+	  || strncmp( ext, ".s28", 4) == 0 || strncmp( ext, ".s37", 4) == 0);
+}
+
 void console_command()
 {
   static char input[80], copy[80];
@@ -237,14 +253,23 @@ void console_command()
 	console_active = 1;
 	printf("> ");
 	fflush(stdout);
+	hostio_console(1);
 	if(fgets(input, 80, stdin) == 0)
 	  return;
+	hostio_console(0);
 	if (strlen(input) == 1)
 	  strptr = copy;
 	else
 	  strptr = strcpy(copy, input);
 	
 	switch (next_char(&strptr)) {
+	case 'b' :
+	  if (more_params(&strptr)) {
+		if ((i = break_set(strptr)) != 0)
+		  printf("Breakpoint %d set\n", i);
+	  } else
+		break_list();
+	  break;
 	case 'c' :
 	  for (n = 0; n < 0x10000; n++)
 	set_memb((uint16_t)n, 0);
@@ -295,12 +320,15 @@ void console_command()
 	  break;
 	case 'h' : case '?' :
 	  printf("     HELP for the 6809 simulator debugger\n\n");
+	  printf("   b               : list breakpoints\n");
+	  printf("   b adr [count n] [log] [if cond] : set breakpoint (log = trace only)\n");
 	  printf("   c               : clear memory\n");
 	  printf("   d [start] [end] : disassemble memory from <start> to <end>\n");
 	  printf("   f adr           : step forward until PC = <adr>\n");
 	  printf("   g [adr]         : start execution at current address or <adr>\n");
 	  printf("   h, ?            : show this help page\n");
-	  printf("   l file(s)       : load binary file : .s19, .hex or .b[in] (at adress <start>)\n");
+	  printf("   k [n]           : remove breakpoint <n> (all if omitted)\n");
+	  printf("   l file(s)       : load binary file : .s19/.s28/.s37, .hex or .b[in] (at adress <start>)\n");
 	  printf("   m [start] [end] : dump memory from <start> to <end>\n");
 	  printf("   n [n]           : next [n] instruction(s)\n");
 	  printf("   p adr           : set PC to <adr>\n");
@@ -313,14 +341,21 @@ void console_command()
 	  printf("   u               : toggle dump registers\n");
 	  printf("   v               : show devices registers\n");
 	  printf("   w               : toggle show devices\n");
+	  printf("   x               : reset the cpu and the devices\n");
 	  printf("   y [0]           : show number of 6809 cycles [or set it to 0]\n");
 	  break;
+	case 'k' :
+	  if (more_params(&strptr))
+		break_clear(readint(&strptr));
+	  else
+		break_clear(0);
+	  break;
 	case 'l' :
 	  if (more_params(&strptr)) {
 printf("taille : %ld - '%s'\n", strlen (strptr), strptr);
 		fname = mmalloc( strlen( strptr));
 		strcpy( fname, readstr(&strptr));
-		if (strncmp( strchr( fname, '.'), ".s19", 4) == 0)
+		if (srec_ext( fname))
 		  load_motos1( readstr( &strptr));
 		else if (strncmp( strchr( fname, '.'), ".hex", 4) == 0)
 		  load_intelhex( readstr( &strptr));
@@ -420,16 +455,22 @@ printf("taille : %ld - '%s'\n", strlen (strptr), strptr);
 	  devon ^= 1;
 	  printf("Show devices registers %s\n", devon ? "on" : "off");
 	  break;
+	case 'x' :
+	  device_reset();
+	  reset();
+	  printf("Reset, PC = %04X\n", rpc);
+	  break;
 	case 'y' :
 	  if (more_params(&strptr))
 	if(readint(&strptr) == 0) {
 	  cycles = 0;
+	  dev_deadline = 0;
 	  printf("Cycle counter initialized\n");
 	} else
 	  printf("Syntax Error. Type 'h' to show help.\n");
 	  else {
-		double sec = (double)cycles / 1000000.0;
-		printf("Cycle counter: %ld\nEstimated time at 1 Mhz : %g seconds\n", cycles, sec);
+		double sec = (double)cycles / CPU_CLOCK;
+		printf("Cycle counter: %ld\nEstimated time at %g Mhz : %g seconds\n", cycles, CPU_CLOCK / 1e6, sec);
 	  }
 	  break;
 	default :
@@ -442,8 +483,10 @@ printf("taille : %ld - '%s'\n", strlen (strptr), strptr);
 void usage( char *cmd) {
 	printf("Usage: %s [-h] => this help\n", cmd);
 	printf("       %s <file>.b[in] [hexpos] => load raw binary file at hexpos (default: end at $FFFF)\n", cmd);
-	printf("       %s <file>.s19 [...] => load 1..n motorola .s19 file(s)\n", cmd);
+	printf("       %s <file>.s19 [...] => load 1..n motorola .s19/.s28/.s37 file(s)\n", cmd);
 	printf("       %s <file>.hex [...] => load 1..n intel .hex file(s)\n", cmd);
+	printf("       %s -z <image> <image>.dsz => compress a disk image for the fd1795\n", cmd);
+	printf("Set SIM6809_CACHE to a directory to keep parsed .s19/.hex images there\n");
 	exit(0);
 }
 
@@ -454,7 +497,12 @@ void parse_cmdline(int argc, char **argv)
   if (--argc == 0 || strncmp( param, "-h", 2) == 0)
 	usage( cmd);
 
-  if (strncmp( strchr( param, '.'), ".s19", 4) == 0)
+  if (strcmp( param, "-z") == 0)
+	if (argc == 3)
+	  exit( !dsz_create( argv[1], argv[2]));
+	else
+	  usage( cmd);
+  else if (srec_ext( param))
   	while (argc-- > 0)
 	  load_motos1( *argv++);
   else if (strncmp( strchr( param, '.'), ".hex", 4) == 0)
@@ -480,11 +528,11 @@ int main(int argc, char **argv)
   get_config( geteuid());		// initialise hardware drivers
   console_init();
   m6809_init();
+  if (rpc == 0 && image_entry > 0 && image_entry < 0x10000) // no reset vector
+	rpc = image_entry;
   setup_brkhandler();
 
   console_command();
 
-  // unload drivers
-//  acia_destroy();
   return 0;
 }
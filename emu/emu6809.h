@@ -55,12 +55,20 @@ void execute_addr(uint16_t addr);
 void ignore_ws(char **c);
 uint16_t readhex(char **c);
 int readint(char **c);
+char *readstr(char **c);
 int more_params(char **c);
 char next_char(char **c);
 void console_command(void);
 void parse_cmdline(int argc, char **argv);
 int main(int argc, char **argv);
 
+/* breakpoint.c */
+extern uint8_t bpmap[];
+int break_set(char *args);
+void break_clear(int id);
+void break_list(void);
+int break_check(uint16_t adr);
+
 /* hardware.c */
 void get_config( uid_t uid);
 
@@ -235,11 +243,21 @@ void firq(void);
 void nmi(void);
 
 /* memory.c */
+extern uint8_t *mempage[16];
+extern uint32_t pagephys[16];
+extern uint32_t phys_size;
 int memory_init(void);
 uint8_t get_memb(uint16_t adr);
+uint8_t mem_read_under(uint16_t adr);
 uint16_t get_memw(uint16_t adr);
 void set_memb(uint16_t adr, uint8_t val);
 void set_memw(uint16_t adr, uint16_t val);
+int phys_grow(uint32_t size);
+void mem_map_page(int page, uint32_t phys);
+void mem_write_range(uint32_t adr, uint8_t *buf, int len);
+void mem_write_wrap(uint16_t adr, uint8_t *buf, int len);
+void mem_read_range(uint32_t adr, uint8_t *buf, int len);
+int rom_map(char *filename);
 
 /* misc.c */
 char hexdigit(uint16_t v);
@@ -247,9 +265,20 @@ char *hex8str(uint8_t v);
 char *hex16str(uint16_t v);
 char *bin8str(uint8_t val);
 char *ccstr(uint8_t val);
+int hexdecode(const char *src, uint8_t *dst, int n);
 
 /* miscutils.c */
 void *mmalloc(size_t n);
+void *map_file(char *filename, size_t *len);
+void unmap_file(void *p, size_t len);
+
+/* imgcache.c */
+extern long image_entry;
+extern int cache_recording;
+int cache_load(char *filename);
+void cache_begin(void);
+void cache_record(uint32_t adr, int len);
+void cache_end(char *filename, uint8_t *img, size_t len);
 
 /* intel.c */
 void load_intelhex(char *filename);
@@ -0,0 +1,237 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4: */
+/* imgcache.c -- binary cache of parsed .s19 / .hex images
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "emu6809.h"
+#include "../hardware/hardware.h"
+
+/*
+ * When the environment variable SIM6809_CACHE names a directory, the
+ * memory image produced by parsing a text file is saved there : address
+ * ranges, bytes and entry point. The next load of the same file only maps
+ * the cache and copies the ranges back to memory.
+ * A cache is used as long as the source has the same mtime and size, or
+ * if its content still has the same hash (the mtime is then refreshed).
+ * Cache files are named after the hash of the source path.
+ */
+
+#define CACHE_MAGIC "S6809IMG"
+#define CACHE_VERSION 1
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nranges;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t size;
+	uint64_t hash;
+	int64_t entry;
+};
+
+struct CacheRange {
+	uint32_t addr;
+	uint32_t len;
+};
+
+long image_entry = -1;	// entry point of the last image loaded, -1 if none
+
+static struct CacheRange *ranges = NULL;
+static int nranges, maxranges;
+int cache_recording = 0;
+
+// FNV-1a, 64 bits
+static uint64_t hash( const uint8_t *p, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len-- > 0) {
+	h ^= *p++;
+	h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static char *cache_dir(void) {
+  char *dir = getenv( "SIM6809_CACHE");
+
+  return (dir != NULL && *dir != '\0') ? dir : NULL;
+}
+
+// name of the cache file for a source file, NULL if no cache
+static char *cache_name( char *filename) {
+  static char name[PATH_MAX + 32];
+  char path[PATH_MAX];
+  char *dir;
+
+  if ((dir = cache_dir()) == NULL)
+	return NULL;
+  if (realpath( filename, path) == NULL)
+	return NULL;
+  snprintf( name, sizeof( name), "%s/%016llx.img", dir,
+	  (unsigned long long)hash( (uint8_t *)path, strlen( path)));
+  return name;
+}
+
+// load an image from the cache, returns 1 if done
+int cache_load( char *filename) {
+  struct CacheHeader *hdr;
+  struct CacheRange *rg;
+  struct stat st;
+  uint8_t *img, *data, *src;
+  size_t len, srclen;
+  char *name;
+  int64_t mtime[2];
+  uint32_t i;
+  int fd, valid = 0;
+
+  if ((name = cache_name( filename)) == NULL || stat( filename, &st) < 0)
+	return 0;
+  if ((img = map_file( name, &len)) == NULL)
+	return 0;
+  hdr = (struct CacheHeader *)img;
+  rg = (struct CacheRange *)(hdr + 1);
+  if (len < sizeof( struct CacheHeader)
+	  || memcmp( hdr->magic, CACHE_MAGIC, 8) != 0
+	  || hdr->version != CACHE_VERSION
+	  || len < sizeof( struct CacheHeader) + hdr->nranges * sizeof( struct CacheRange)
+	  || hdr->size != st.st_size) {
+	unmap_file( img, len);
+	return 0;
+  }
+
+  if (hdr->mtime_sec == st.st_mtim.tv_sec && hdr->mtime_nsec == st.st_mtim.tv_nsec)
+	valid = 1;
+  else if ((src = map_file( filename, &srclen)) != NULL) {
+	if (hash( src, srclen) == hdr->hash) {	// touched but not modified
+	  valid = 1;
+	  mtime[0] = st.st_mtim.tv_sec;
+	  mtime[1] = st.st_mtim.tv_nsec;
+	  if ((fd = open( name, O_WRONLY)) >= 0) {
+		pwrite( fd, mtime, sizeof( mtime), offsetof( struct CacheHeader, mtime_sec));
+		close( fd);
+	  }
+	}
+	unmap_file( src, srclen);
+  }
+
+  if (valid) {
+	data = (uint8_t *)(rg + hdr->nranges);
+	for (i = 0; i < hdr->nranges; i++) {
+	  if (data + rg[i].len > img + len) {
+		valid = 0;
+		break;
+	  }
+	  data += rg[i].len;
+	}
+  }
+  if (valid) {
+	data = (uint8_t *)(rg + hdr->nranges);
+	loading = 1;
+	for (i = 0; i < hdr->nranges; i++) {
+	  mem_write_range( rg[i].addr, data, rg[i].len);
+	  data += rg[i].len;
+	}
+	loading = 0;
+	image_entry = hdr->entry;
+  }
+  unmap_file( img, len);
+  return valid;
+}
+
+// start recording the ranges written by the loader
+void cache_begin(void) {
+  nranges = 0;
+  image_entry = -1;
+  cache_recording = cache_dir() != NULL;
+}
+
+// called by mem_write_range() while recording
+void cache_record( uint32_t adr, int len) {
+  if (nranges > 0 && ranges[nranges-1].addr + ranges[nranges-1].len == adr) {
+	ranges[nranges-1].len += len;
+	return;
+  }
+  if (nranges == maxranges) {
+	maxranges = maxranges ? 2 * maxranges : 64;
+	if ((ranges = realloc( ranges, maxranges * sizeof( struct CacheRange))) == NULL) {
+	  fprintf( stderr, "Not enough memory for image cache\n");
+	  abort();
+	}
+  }
+  ranges[nranges].addr = adr;
+  ranges[nranges].len = len;
+  nranges++;
+}
+
+// save the image just loaded from the source img/len
+void cache_end( char *filename, uint8_t *img, size_t len) {
+  struct CacheHeader hdr;
+  struct stat st;
+  char *name, tmp[PATH_MAX + 40];
+  uint8_t buf[256];
+  uint32_t adr, n, left;
+  FILE *fc;
+  int i, fd;
+
+  cache_recording = 0;
+  if ((name = cache_name( filename)) == NULL || stat( filename, &st) < 0)
+	return;
+
+  memset( &hdr, 0, sizeof( hdr));
+  memcpy( hdr.magic, CACHE_MAGIC, 8);
+  hdr.version = CACHE_VERSION;
+  hdr.nranges = nranges;
+  hdr.mtime_sec = st.st_mtim.tv_sec;
+  hdr.mtime_nsec = st.st_mtim.tv_nsec;
+  hdr.size = st.st_size;
+  hdr.hash = hash( img, len);
+  hdr.entry = image_entry;
+
+  // written aside then renamed, for concurrent simulators
+  snprintf( tmp, sizeof( tmp), "%s.XXXXXX", name);
+  if ((fd = mkstemp( tmp)) < 0 || (fc = fdopen( fd, "w")) == NULL) {
+	if (fd >= 0)
+	  close( fd);
+	return;
+  }
+  fwrite( &hdr, sizeof( hdr), 1, fc);
+  fwrite( ranges, sizeof( struct CacheRange), nranges, fc);
+  for (i = 0; i < nranges; i++) {
+	adr = ranges[i].addr;
+	for (left = ranges[i].len; left > 0; left -= n) {
+	  n = left > sizeof( buf) ? sizeof( buf) : left;
+	  mem_read_range( adr, buf, n);
+	  fwrite( buf, 1, n, fc);
+	  adr += n;
+	}
+  }
+  if (fclose( fc) == 0)
+	rename( tmp, name);
+  else
+	unlink( tmp);
+}
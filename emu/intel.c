@@ -16,96 +16,102 @@
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "config.h"
 #include "emu6809.h"
 #include "../hardware/hardware.h"
 
-#define READC (*(*ptr)++)
-#define GETB (xdigitconv(READC) * 16 + xdigitconv(READC))
+/* a record holds at most 255 data bytes, plus count, address, type
+   and checksum */
+static uint8_t record[255 + 5];
 
-static char linebuf[80];
-static unsigned char checksum;
+/* base address set by extended segment (02) or linear (04) records */
+static uint32_t base;
 
-static int xdigitconv(char c)
+/* decode a record from the ':' on, without any copy of the text.
+   Returns 1 at end of file, -1 on error, 0 otherwise */
+static int read_record(char *line, size_t len)
 {
-  if (c >= '0' && c <= '9')
-    return c - '0';
-  else if (c >= 'a' && c <= 'f')
-    return c - 'a' + 10;
-  else
-    return c - 'A' + 10;
-}
-
-static unsigned char read_byte(char **ptr)
-{
-  unsigned char val = GETB;
-
-  checksum += val;
-  return val;
-}
-
-static unsigned int read_word(char **ptr)
-{
-  unsigned int val1 = GETB;
-  unsigned int val2 = GETB;
-
-  checksum += val1;
-  checksum += val2;
-
-  return val1 * 256 + val2;
-}
-						 
-static int read_line(void)
-{
-  char *strptr = linebuf;
-  int len, i;
+  int sum, n;
   uint16_t addr;
-  unsigned char type;
 
-  if (*strptr++ != ':') {
+  if (*line++ != ':' || len < 11 || hexdecode(line, record, 1) < 0) {
     printf("Bad record\n");
-    return 1;
+    return -1;
   }
-
-  checksum = 0;
-
-  len = read_byte(&strptr);
-  addr = read_word(&strptr);
-  type = read_byte(&strptr);
-
-  for (i = 1; i <= len; i++)
-    set_memb(addr++, read_byte(&strptr));
-
-  read_byte(&strptr);
-
-  if (checksum != 0) {
+  n = record[0];
+  if (len < 11 + 2 * n || (sum = hexdecode(line, record, n + 5)) < 0) {
+    printf("Bad record\n");
+    return -1;
+  }
+  if ((sum & 0xff) != 0) {
     printf("Bad checksum\n");
-    return 1;
+    return -1;
   }
 
-  if (type == 1)
+  addr = record[1] << 8 | record[2];
+  switch (record[3]) {
+  case 0:
+    if (base == 0)	/* plain 16 bits record */
+      mem_write_wrap(addr, record + 4, n);
+    else
+      mem_write_range(base + addr, record + 4, n);
+    return 0;
+  case 1:
     return 1;
-  else
+  case 2:		/* extended segment address */
+    if (n == 2)
+      base = (record[4] << 8 | record[5]) << 4;
+    return 0;
+  case 4:		/* extended linear address */
+    if (n == 2)
+      base = (uint32_t)(record[4] << 8 | record[5]) << 16;
     return 0;
+  case 5:		/* start linear address */
+    if (n == 4)
+      image_entry = (long)record[6] << 8 | record[7];
+    return 0;
+  default:
+    return 0;
+  }
 }
 
 void load_intelhex(char *filename)
 {
-  FILE *fp;
-  int end = 0;
+  char *img, *line, *eol, *end;
+  size_t len;
+  int r = 0;
 
   printf("loading intel file %s ... ", filename);
-  fp = fopen(filename, "r");
+  if (cache_load(filename)) {
+    printf("done (cached).\n");
+    return;
+  }
+  img = map_file(filename, &len);
 
-  if (!fp) {
+  if (!img) {
     printf("can't open it, sorry.\n");
     return;
   }
 
+  cache_begin();
+  base = 0;
   loading = 1;
-  while (fgets(linebuf, 80, fp) != NULL && !end)
-    end = read_line();
+  end = img + len;
+  for (line = img; line < end && r == 0; line = eol + 1) {
+    if ((eol = memchr(line, '\n', end - line)) == NULL)
+      eol = end;
+    if (eol > line && eol[-1] == '\r')
+      r = (eol - 1 > line) ? read_record(line, eol - 1 - line) : 0;
+    else
+      r = (eol > line) ? read_record(line, eol - line) : 0;
+  }
   loading = 0;
+  if (r >= 0) {
+    cache_end(filename, (uint8_t *)img, len);
+    printf("done.\n");
+  } else
+    cache_recording = 0;
+  unmap_file(img, len);
 }
-
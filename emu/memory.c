@@ -18,6 +18,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "config.h"
 #include "emu6809.h"
@@ -25,30 +30,103 @@
 
 #include "../hardware/hardware.h"
 
-uint8_t *ramdata;    /* 64 kb of ram */
+uint8_t *ramdata;    /* physical memory, at least 64 kb */
+uint32_t phys_size;  /* size of physical memory */
+
+/* Logical to physical translation by 4K pages, updated by memory mapping
+   devices. mempage[] holds host pointers so that an access is a single
+   indexed load, pagephys[] the physical address of each page */
+uint8_t *mempage[16];
+uint32_t pagephys[16];
+
+/* ROM image mapped read only from its file, shared between all the
+   simulators using it. Serves addresses rom_image..$FFFF */
+static uint8_t *romdata = NULL;
+static uint32_t rom_image = 0x10000;
+static int rom_warned = 0;	/* a load tried to write into the image */
 
 int memory_init(void)
 {
-  ramdata = (uint8_t *)mmalloc(0x10000);
+  int i;
+
+  phys_size = 0x10000;
+  ramdata = (uint8_t *)mmalloc(phys_size);
+  for (i = 0; i < 16; i++) {
+    pagephys[i] = i << 12;
+    mempage[i] = ramdata + pagephys[i];
+  }
+
+  return 1;
+}
 
+/* grow physical memory up to size bytes, returns 0 if impossible */
+int phys_grow(uint32_t size)
+{
+  uint8_t *p;
+  uint32_t n;
+  int i;
+
+  if (size <= phys_size)
+    return 1;
+  if (size > PHYS_MAX) {
+    printf("physical address %06X beyond %06X\n", size - 1, PHYS_MAX - 1);
+    return 0;
+  }
+  for (n = phys_size; n < size; n *= 2)
+    ;
+  if (n > PHYS_MAX)
+    n = PHYS_MAX;
+  if ((p = realloc(ramdata, n)) == NULL) {
+    printf("Not enough memory for %d kb of physical memory\n", n >> 10);
+    return 0;
+  }
+  memset(p + phys_size, 0, n - phys_size);
+  ramdata = p;
+  phys_size = n;
+  for (i = 0; i < 16; i++)
+    mempage[i] = ramdata + pagephys[i];
   return 1;
 }
 
+/* map the logical 4K page to the physical address phys */
+void mem_map_page(int page, uint32_t phys)
+{
+  phys &= ~0x0fff;
+  if (!phys_grow(phys + 0x1000))
+    return;
+  pagephys[page] = phys;
+  mempage[page] = ramdata + phys;
+}
+
 uint8_t get_memb(uint16_t adr)
 {
+  struct Device *dev;
+
   // not hardware
-  if (look_dev( adr) == NULL) {
+  if ((dev = look_dev( adr)) == NULL) {
     if (adr < mem_low || (adr >= mem_high && adr < rom)) {
       printf( "read %04X mem_low %04X mem_high %04X, ROM %04X\n", adr, mem_low, mem_high, rom);
       err6809 = ERR_NO_MEMORY;
       return (0);
     }
-    return ramdata[adr];
+    return mem_read_under(adr);
   } else {
-	return read_device( adr);  // hardware mapper
+	return dev_read( dev, adr);  // hardware mapper
   }
 }
 
+/* memory seen at this address, whatever the devices : rom is not
+   translated, ram goes through the page table */
+uint8_t mem_read_under(uint16_t adr)
+{
+  if (adr >= rom) {
+    if (adr >= rom_image)
+      return romdata[adr - rom_image];
+    return ramdata[adr];
+  }
+  return mempage[adr >> 12][adr & 0x0fff];
+}
+
 uint16_t get_memw(uint16_t adr)
 {
   return (uint16_t)get_memb(adr) << 8 | (uint16_t)get_memb(adr + 1);
@@ -56,28 +134,30 @@ uint16_t get_memw(uint16_t adr)
 
 void set_memb(uint16_t adr, uint8_t val)
 {
+  struct Device *dev;
+
 // Protecting some memory space
   if (loading) {
     ramdata[adr] = val;
 	return;
   }
-  if (adr >= rom) {
-      printf( "write %04X mem_low %04X mem_high %04X, ROM %04X\n", adr, mem_low, mem_high, rom);
-      err6809 = ERR_WRITE_PROTECTED;
-    return;
-  }
 
 // managing memory available on simulated hardware
-  if (look_dev( adr) == NULL) { // not inside io space ?
+  if ((dev = look_dev( adr)) == NULL) { // not inside io space ?
+    if (adr >= rom) {
+      printf( "write %04X mem_low %04X mem_high %04X, ROM %04X\n", adr, mem_low, mem_high, rom);
+      err6809 = ERR_WRITE_PROTECTED;
+      return;
+    }
     if (adr < mem_low || adr >= mem_high) {
       printf( "write %04X mem_low %04X mem_high %04X, ROM %04X\n", adr, mem_low, mem_high, rom);
       err6809 = ERR_NO_MEMORY;
       return;
     }
-    ramdata[adr] = val;
+    mempage[adr >> 12][adr & 0x0fff] = val;
     return;
   } else
-	write_device( adr, val);
+	dev_write( dev, adr, val);
 }
 
 void set_memw(uint16_t adr, uint16_t val)
@@ -86,4 +166,86 @@ void set_memw(uint16_t adr, uint16_t val)
   set_memb(adr + 1, (uint8_t)val);
 }
 
+/* map a rom image file, ending at $FFFF, instead of copying it */
+int rom_map(char *filename)
+{
+  struct stat st;
+  uint32_t adr;
+  void *p;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    printf("rom image %s unreachable\n", filename);
+    if (fd >= 0)
+      close(fd);
+    return 0;
+  }
+  if (st.st_size == 0 || st.st_size > 0x10000 - rom) {
+    printf("rom image %s doesn't fit in %04X-FFFF\n", filename, rom);
+    close(fd);
+    return 0;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    printf("can't map rom image %s\n", filename);
+    return 0;
+  }
+  if (romdata != NULL)
+    munmap(romdata, 0x10000 - rom_image);
+  romdata = p;
+  rom_image = 0x10000 - st.st_size;
+  rom_warned = 0;
+  printf("rom image %s mapped at %04X-FFFF\n", filename, rom_image);
+  for (adr = rom_image; adr < 0x10000; adr++)
+    if (ramdata[adr] != 0) {	/* loaded before the image was mapped */
+      printf("what was loaded at %04X-FFFF is hidden by the rom image\n", rom_image);
+      break;
+    }
+  return 1;
+}
+
+/* bulk store used by the loaders at a physical address : memory is written
+   directly like set_memb() does while loading, so a run is a single memcpy */
+void mem_write_range(uint32_t adr, uint8_t *buf, int len)
+{
+  uint32_t end = adr + len;
+
+  /* the mapped rom image would hide the bytes loaded under it */
+  if (romdata != NULL && adr < 0x10000 && end > rom_image) {
+    if (!rom_warned)
+      printf("load into the rom image %04X-FFFF ignored\n", rom_image);
+    rom_warned = 1;
+    if (adr < rom_image)
+      mem_write_range(adr, buf, rom_image - adr);
+    if (end > 0x10000)
+      mem_write_range(0x10000, buf + (0x10000 - adr), end - 0x10000);
+    return;
+  }
+  if (!phys_grow(adr + len))
+    return;
+  if (cache_recording)
+    cache_record(adr, len);
+  memcpy(ramdata + adr, buf, len);
+}
 
+/* bulk store of a record with a 16 bits address, wrapping around at $FFFF
+   as the cpu would, instead of going on above 64K */
+void mem_write_wrap(uint16_t adr, uint8_t *buf, int len)
+{
+  int n = 0x10000 - adr;
+
+  if (n < len) {
+    mem_write_range(adr, buf, n);
+    buf += n;
+    len -= n;
+    adr = 0;
+  }
+  mem_write_range(adr, buf, len);
+}
+
+/* raw copy of physical memory, as the loaders left it */
+void mem_read_range(uint32_t adr, uint8_t *buf, int len)
+{
+  memcpy(buf, ramdata + adr, len);
+}
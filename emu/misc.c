@@ -22,6 +22,9 @@
 
 static const char ccbits[] = "EFHINZVC";
 
+static uint16_t hexpair[0x10000];	// 2 ascii digits -> byte, 0x100 if invalid
+static int hexpair_ready = 0;
+
 char hexdigit(uint16_t v)
 {
   v &= 0xf;
@@ -87,3 +90,48 @@ char *ccstr(uint8_t val)
 
   return tempbuf;
 }
+
+static int xdigit(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static void hexpair_init(void)
+{
+  int hi, lo;
+
+  for (hi = 0; hi < 256; hi++)
+    for (lo = 0; lo < 256; lo++)
+      if (xdigit(hi) < 0 || xdigit(lo) < 0)
+        hexpair[hi << 8 | lo] = 0x100;
+      else
+        hexpair[hi << 8 | lo] = xdigit(hi) << 4 | xdigit(lo);
+  hexpair_ready = 1;
+}
+
+/* decode n bytes from 2n hex digits, one table lookup per byte.
+   Returns the sum of the bytes (for checksums), or -1 on a bad digit */
+int hexdecode(const char *src, uint8_t *dst, int n)
+{
+  const unsigned char *s = (const unsigned char *)src;
+  uint16_t v, bad = 0;
+  int sum = 0;
+
+  if (!hexpair_ready)
+    hexpair_init();
+
+  while (n-- > 0) {
+    v = hexpair[s[0] << 8 | s[1]];
+    bad |= v;
+    *dst++ = (uint8_t)v;
+    sum += (uint8_t)v;
+    s += 2;
+  }
+  return (bad & 0x100) ? -1 : sum;
+}
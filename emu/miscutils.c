@@ -19,6 +19,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "config.h"
 
@@ -33,3 +36,30 @@ void *mmalloc(size_t n)
   }
   return p;
 }
+
+/* map a whole file read only, returns NULL if it can't be done */
+void *map_file(char *filename, size_t *len)
+{
+  struct stat st;
+  void *p;
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  *len = st.st_size;
+  return p;
+}
+
+void unmap_file(void *p, size_t len)
+{
+  munmap(p, len);
+}
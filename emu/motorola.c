@@ -1,5 +1,5 @@
 /* vim: set noexpandtab ai ts=4 sw=4 tw=4:
-   motorola.c -- Motorola S1 support 
+   motorola.c -- Motorola S1/S2/S3 support 
    Copyright (C) 1999 Noah Vawter
 
    This program is free software; you can redistribute it and/or modify
@@ -24,53 +24,91 @@
 #include "emu6809.h"
 #include "../hardware/hardware.h"
 
+/* a record holds count, 2 to 4 bytes of address, the data bytes and the
+   checksum. Returns 1 at end of file, -1 on error, 0 otherwise */
+static int read_srecord(char *line, size_t len)
+{
+  uint8_t record[256];
+  uint32_t addr;
+  int sum, n, i, alen;
+
+  if (len < 4 || line[0] != 'S' || hexdecode(line + 2, record, 1) < 0)
+    return -1;
+  n = record[0];
+  if (len < 4 + 2 * n || (sum = hexdecode(line + 2, record, n + 1)) < 0)
+    return -1;
+  if ((sum & 0xff) != 0xff) {
+    printf("Bad checksum\n");
+    return -1;
+  }
+
+  switch (line[1]) {
+  case '1': case '9':	/* 16 bits address */
+    alen = 2;
+    break;
+  case '2': case '8':	/* 24 bits address */
+    alen = 3;
+    break;
+  case '3': case '7':	/* 32 bits address */
+    alen = 4;
+    break;
+  default:		/* header, count... */
+    return 0;
+  }
+  if (n < alen + 1)
+    return -1;
+  for (addr = 0, i = 1; i <= alen; i++)
+    addr = addr << 8 | record[i];
+
+  if (line[1] <= '3') {	/* data */
+    if (alen == 2)
+      mem_write_wrap(addr, record + alen + 1, n - alen - 1);
+    else
+      mem_write_range(addr, record + alen + 1, n - alen - 1);
+    return 0;
+  }
+  image_entry = addr;	/* end of file, with entry point */
+  return 1;
+}
+
 int load_motos1(char *filename)
 {
-  char buf[201];
-  char *r;
-  int num_bytes,i,p,done=0;
-  long start_addr;
-  unsigned char value;
-  FILE *fi;
+  char *img, *line, *eol, *end;
+  size_t len;
+  int nl, r = 0;
 	
   printf("loading motorola file %s ... ", filename);
-  fi=fopen(filename,"r");
-  if (fi==NULL)
+  if (cache_load(filename)) {
+    printf("done (cached).\n");
+    return(1);
+  }
+  img = map_file(filename, &len);
+  if (img == NULL)
   {
     printf("can't open it, sorry.\n");
     return(0);
   }
   
+  cache_begin();
   loading = 1;
-  r = fgets(buf,200,fi);
-  while(!done)
-  {
-    /* read len */  /* 2 bytes of addr, 1 byte is checksum */
-    num_bytes = (16*hex_to_int(buf[2])+hex_to_int(buf[3]))-3;
-    
-    /* read addr */
-    start_addr=0;
-    for(p=4,i=0;i<4;i++)
-      start_addr = (start_addr<<4) + hex_to_int(buf[p++]);
-
-    /* read data */
-    for(i=0;i<num_bytes;i++) {
-      value = 16*hex_to_int(buf[p])+hex_to_int(buf[p+1]);
-      p+=2;
-      set_memb(start_addr+i,value);
-      //      printf("0x%08x: 0x%02x\n",start_addr+i,value);
-    }
-
-    /* check for ending */
-    if(!strncmp("S9",buf,2))
-    {
-      break;   /* done */
-    }
-    r = fgets(buf,200,fi);
-    if(feof(fi))done=1;
+  end = img + len;
+  for (line = img, nl = 1; line < end && r == 0; line = eol + 1, nl++) {
+    if ((eol = memchr(line, '\n', end - line)) == NULL)
+      eol = end;
+    len = eol - line;
+    if (len > 0 && line[len - 1] == '\r')
+      len--;
+    if (len > 0 && (r = read_srecord(line, len)) < 0)
+      printf("error at line %d\n", nl);
   }
   loading = 0;
-  fclose(fi);
+  if (r < 0) {
+    cache_recording = 0;
+    unmap_file(img, end - img);
+    return(0);
+  }
+  cache_end(filename, (uint8_t *)img, end - img);
+  unmap_file(img, end - img);
   printf( "done.\n");
   return(1);
 }
@@ -28,22 +28,18 @@
 
 void load_raw( char *filename, char *pos)
 {
-  long int bin_end, bin_pos, bin_len, addr;
-  FILE *fi;
-  int c;
+  long int bin_pos, bin_len;
+  uint8_t *img;
+  size_t len;
 	
   printf("loading binary file %s ... ", filename);
-  fi=fopen(filename,"r");
-  if (fi==NULL)
+  img = map_file( filename, &len);
+  if (img == NULL)
   {
     printf("can't open it, sorry.\n");
     return;
   }
-  fseek( fi, 0L, SEEK_END);
-  if( (bin_len = ftell( fi)) < 0) {
-	printf( "file error, aborting.\n");
-	return;
-  }
+  bin_len = len;
   if (pos[0] == '0' && pos[1] == 'x')
 	sscanf( pos, "%lx", &bin_pos);
   else
@@ -54,20 +50,15 @@ void load_raw( char *filename, char *pos)
 
   if( bin_pos + bin_len > 0x10000 || bin_pos < 0) {
 	printf( "Position/length mismatch : 0x%04X/0x%04X, aborting.\n", bin_pos, bin_len);
+	unmap_file( img, len);
 	return;
   }
 
-// reading and processing file...
+// copying the whole image at once
   
   loading = 1;
-  fseek( fi, 0L, SEEK_SET);
-  for (addr = bin_pos; addr < bin_pos + bin_len; addr++) {
-	c =  fgetc(fi);
-	set_memb( addr, c);
-    
-  }
-
+  mem_write_range( bin_pos, img, bin_len);
   loading = 0;
   printf( "0x%04X bytes loaded at Ox%04X.\n", bin_len, bin_pos);
-  fclose(fi);
+  unmap_file( img, len);
 }
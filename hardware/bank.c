@@ -0,0 +1,121 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4:
+   bank.c -- bank switching latch for memory beyond 64K
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _XOPEN_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdlib.h>
+#include "../emu/config.h"
+#include "../emu/emu6809.h"
+#include "hardware.h"
+
+struct Bank {
+	uint8_t latch;
+	uint32_t low;		// window in logical memory, 4K aligned
+	uint32_t high;
+	uint32_t size;
+};
+
+/*
+   A latch selecting which bank of physical memory appears in a
+   window of the 64K address space. Bank 0 is the memory normally seen in
+   the window, bank n > 0 is at physical address 0x10000 + (n-1) * size,
+   so that S2/S3 or extended Intel HEX images loaded above 64K are reached
+   through it.
+   Ex: bank E040 8000 C000 # 16K window at 8000, latch at E040
+*/
+
+static void bank_select( struct Bank *bank) {
+	uint32_t phys;
+	int page;
+
+	for (page = bank->low >> 12; page < (bank->high + 0xfff) >> 12; page++) {
+	  if (bank->latch == 0)
+		phys = page << 12;
+	  else
+		phys = 0x10000 + (bank->latch - 1) * bank->size + (page << 12) - bank->low;
+	  mem_map_page( page, phys);
+	}
+}
+
+// Initialisation at reset
+void bank_reset( struct Device *dev) {
+	struct Bank *bank;
+
+	bank = dev->registers;
+	bank->latch = 0;
+	bank_select( bank);
+}
+
+// Creation of bank latch
+void bank_init( char* name, uint16_t adr, char *args) {
+	struct Device *new;
+	struct Bank *bank;
+	uint16_t low, high;
+
+	low = readhex( &args);
+	high = readhex( &args);
+
+	// Create a device and allocate space for data
+	new = mmalloc( sizeof( struct Device));
+	strcpy( new->devname, name);
+	new->ops = &bank_ops;
+	new->addr = adr;
+	new->end = adr+1;
+	new->interrupt = 'X';
+	bank = mmalloc( sizeof( struct Bank));
+	new->registers = bank;
+	bank->low = low & 0xf000;
+	bank->high = high ? high : bank->low + 0x1000;	// one page by default
+	if (bank->high <= bank->low) {
+	  printf( "Invalid bank window %04X-%04X\n", low, high);
+	  bank->high = bank->low + 0x1000;
+	}
+	bank->size = ((bank->high + 0xfff) & ~0xfff) - bank->low;
+	dev_add( new);
+	bank_reset( new);
+}
+
+// handle reads
+uint8_t bank_read( struct Device *dev, uint16_t adr) {
+  struct Bank *bank;
+  bank = dev->registers;
+  return bank->latch;
+}
+
+// handle writes
+void bank_write( struct Device *dev, uint16_t adr, uint8_t val) {
+  struct Bank *bank;
+  bank = dev->registers;
+  bank->latch = val;
+  bank_select( bank);
+}
+
+void bank_reg( struct Device *dev) {
+  struct Bank *bank;
+  bank = dev->registers;
+  printf( "BANK:%02X, window %04X-%04X -> physical %06X\n", bank->latch,
+	bank->low, bank->low + bank->size - 1, pagephys[bank->low >> 12]);
+}
+
+const struct DevOps bank_ops = {
+	bank_init, bank_reset, bank_read, bank_write,
+	NULL, NULL, bank_reg
+};
@@ -0,0 +1,690 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4:
+   disk.c -- disk images of the floppy disk controlers
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "../emu/config.h"
+#include "../emu/emu6809.h"
+#include "hardware.h"
+
+/*
+   A disk image is a FLEX one, 256 bytes sectors track after track, its
+   geometry being read from the system information record (0x226 and
+   0x227), a plain DSK of the geometry given, or a JV1, JV3, DMK or IMD
+   image. Whatever the format, the sectors are found in one step through
+   an index by track, side and sector built at mount, holding the offset
+   and length of each sector in the image.
+   The image is mapped in memory (IMD ones being expanded into memory) :
+   - privately by default, what is written being lost at exit
+   - shared with DISK_WRITEBACK : the sectors written are marked in a
+     bitmap, and flushed by runs with msync() when the controler asks for
+     it, with MS_SYNC at exit
+   - read only as the base of an overlay "base.dsk+delta.ovl" : a sector
+     written is first copied into memory, then saved into the overlay file
+     at the next flush. The base may be shared by any number of simulators,
+     each one only storing what it writes. With DISK_DISCARD nothing is
+     saved, with DISK_COMMIT the sectors are written into the base at exit
+     and the overlay emptied.
+   With DISK_FSYNC, the I/O thread of hostio.c waits for the data of each
+   flush to be on disk, the cpu loop going on; else this is done at exit.
+*/
+
+#define OVL_MAGIC "S6809OVL"
+
+// header of an overlay file, followed by the index (slot + 1 of each sector
+// of the base, 0 if not written) and the slots of DISK_SECSIZE bytes
+struct OvlHeader {
+	char magic[8];
+	uint32_t nsec;			// sectors in the base
+	uint32_t nslots;		// sectors in the overlay
+};
+
+static struct Disk *disks = NULL;	// mounted, for the exit
+
+static off_t disk_slot( struct Disk *disk, uint32_t slot) {
+	return sizeof( struct OvlHeader) + disk->size / DISK_SECSIZE * sizeof( uint32_t)
+		+ (off_t)(slot - 1) * DISK_SECSIZE;
+}
+
+// header of an overlay, and its whole index if new
+static void disk_header( struct Disk *disk, int new) {
+	struct OvlHeader h;
+	uint32_t nsec = disk->size / DISK_SECSIZE;
+
+	memcpy( h.magic, OVL_MAGIC, 8);
+	h.nsec = nsec;
+	h.nslots = disk->nslots;
+	if (new)
+	  pwrite( disk->fd, disk->index, nsec * sizeof( uint32_t), sizeof( h));
+	pwrite( disk->fd, &h, sizeof( h), 0);
+	disk->nsaved = disk->nslots;
+}
+
+// write back the sectors written : by runs of contiguous sectors for an
+// image, sector by sector for an overlay, with the index entries of the
+// slots added since the last flush
+void disk_flush( struct Disk *disk, int sync) {
+	long page = sysconf( _SC_PAGESIZE);
+	int n, first, nsec;
+	size_t start;
+
+	if (disk->dir != NULL) {
+	  flexdir_flush( disk);
+	  return;
+	}
+	if (disk->fd < 0 || disk->ndirty == 0)
+	  return;
+	nsec = disk->size / DISK_SECSIZE;
+	for (n = 0; n < nsec; n++) {
+	  if ((disk->dirty[n >> 3] & (1 << (n & 7))) == 0)
+		continue;
+	  if (disk->delta != NULL) {
+		disk->dirty[n >> 3] &= ~(1 << (n & 7));
+		pwrite( disk->fd, disk->delta[n], DISK_SECSIZE, disk_slot( disk, disk->index[n]));
+		if (disk->index[n] > disk->nsaved)
+		  pwrite( disk->fd, &disk->index[n], sizeof( uint32_t),
+			  sizeof( struct OvlHeader) + n * sizeof( uint32_t));
+		continue;
+	  }
+	  for (first = n; n < nsec && (disk->dirty[n >> 3] & (1 << (n & 7))); n++)
+		disk->dirty[n >> 3] &= ~(1 << (n & 7));
+	  start = first * DISK_SECSIZE & ~(page - 1);
+	  msync( disk->dsk + start, n * DISK_SECSIZE - start, sync ? MS_SYNC : MS_ASYNC);
+	}
+	if (disk->delta != NULL && disk->nslots != disk->nsaved)
+	  disk_header( disk, 0);
+	disk->ndirty = 0;
+	if (sync)
+	  fdatasync( disk->fd);
+	else if (disk->mode & DISK_FSYNC)
+	  hostio_post( &disk->sync);	// the cpu loop doesn't wait for the disk
+}
+
+// job of the I/O thread for DISK_FSYNC
+static void disk_datasync( void *arg) {
+	fdatasync( ((struct Disk *)arg)->fd);
+}
+
+// copy the sectors of an overlay into its base, then empty it
+static void disk_commit( struct Disk *disk) {
+	uint32_t n, nsec = disk->size / DISK_SECSIZE;
+	int fd;
+
+	if ((fd = open( disk->base, O_WRONLY)) < 0) {
+	  printf( "Can't commit overlay into %s (errno. %d)\n", disk->base, errno);
+	  return;
+	}
+	for (n = 0; n < nsec; n++)
+	  if (disk->delta[n] != NULL)
+		pwrite( fd, disk->delta[n], DISK_SECSIZE, (off_t)n * DISK_SECSIZE);
+	if (fdatasync( fd) == 0)
+	  ftruncate( disk->fd, 0);
+	close( fd);
+	printf( "%d sectors committed into %s\n", disk->nslots, disk->base);
+}
+
+static void disk_exit( void) {
+	struct Disk *disk;
+
+	for (disk = disks; disk != NULL; disk = disk->next) {
+	  disk_flush( disk, 1);
+	  if ((disk->mode & DISK_COMMIT) && disk->fd >= 0 && disk->nslots > 0)
+		disk_commit( disk);
+	}
+}
+
+// a sector of the image is written
+static void disk_dirty( struct Disk *disk, int n) {
+	if (disk->fd < 0 || (disk->dirty[n >> 3] & (1 << (n & 7))))
+	  return;
+	disk->dirty[n >> 3] |= 1 << (n & 7);
+	disk->ndirty++;
+}
+
+// data of the sector at off, copied into the overlay before being written
+uint8_t *disk_data( struct Disk *disk, int32_t off, int len, int write) {
+	int n = off / DISK_SECSIZE, i;
+
+	if (disk->dir != NULL)
+	  return flexdir_data( disk, off, write);
+	if (disk->dsz != NULL)
+	  return dsz_data( disk, off, write);
+	if (disk->delta != NULL && disk->delta[n] == NULL) {
+	  if (!write)
+		return disk->dsk + off;
+	  disk->delta[n] = mmalloc( DISK_SECSIZE);
+	  memcpy( disk->delta[n], disk->dsk + off, DISK_SECSIZE);
+	  disk->index[n] = ++disk->nslots;
+	}
+	if (write)	// the bitmap is by DISK_SECSIZE, whatever the sector size
+	  for (i = n; i <= (off + len - 1) / DISK_SECSIZE; i++)
+		disk_dirty( disk, i);
+	return disk->delta != NULL ? disk->delta[n] : disk->dsk + off;
+}
+
+// offset and length of a sector in the image, -1 if there is no such sector
+int32_t disk_sector( struct Disk *disk, int track, int side, int sector, int *len) {
+	struct DiskSec *sec;
+
+	if (disk->sec == NULL || track > disk->nbtrk
+		|| sector < disk->firstsec || sector > disk->lastsec)
+	  return -1;
+	if (side >= disk->sides)
+	  side = 0;		// single sided image, as FLEX ones going on both sides
+	sec = &disk->sec[(track * disk->sides + side) * (disk->lastsec - disk->firstsec + 1)
+		+ sector - disk->firstsec];
+	*len = sec->len;
+	return sec->off;
+}
+
+// load the sectors of an overlay, or create it
+static int disk_overlay( struct Disk *disk, char *name) {
+	struct OvlHeader h;
+	uint32_t n, nsec = disk->size / DISK_SECSIZE;
+	int fd;
+
+	if ((fd = open( name, O_RDWR | O_CREAT, 0644)) < 0) {
+	  printf( "overlay %s unreachable\n", name);
+	  return 0;
+	}
+	disk->delta = mmalloc( nsec * sizeof( uint8_t *));
+	memset( disk->delta, 0, nsec * sizeof( uint8_t *));
+	disk->index = mmalloc( nsec * sizeof( uint32_t));
+	memset( disk->index, 0, nsec * sizeof( uint32_t));
+	disk->fd = fd;
+	if (read( fd, &h, sizeof( h)) != sizeof( h))
+	  disk_header( disk, 1);	// new overlay
+	else if (memcmp( h.magic, OVL_MAGIC, 8) != 0 || h.nsec != nsec
+		|| pread( fd, disk->index, nsec * sizeof( uint32_t), sizeof( h)) != nsec * sizeof( uint32_t)) {
+	  printf( "%s is not an overlay of %s\n", name, disk->base);
+	  close( fd);
+	  return 0;
+	} else {
+	  disk->nslots = disk->nsaved = h.nslots;
+	  for (n = 0; n < nsec; n++)
+		if (disk->index[n] != 0) {
+		  disk->delta[n] = mmalloc( DISK_SECSIZE);
+		  pread( fd, disk->delta[n], DISK_SECSIZE, disk_slot( disk, disk->index[n]));
+		}
+	}
+	if (disk->mode & DISK_DISCARD) {
+	  close( fd);
+	  disk->fd = -1;
+	}
+	return 1;
+}
+
+// map an image, shared if written back
+static int disk_map( struct Disk *disk, char *name, int writeback) {
+	struct stat dsk_stat;
+	int fd, flags;
+
+	if (stat( name, &dsk_stat)) {
+		printf( "disk image %s unreachable\n", name);
+		return 0;
+	}
+	if (dsk_stat.st_size < 32) {
+		printf( "disk image %s too small\n", name);
+		return 0;
+	}
+	if (dsk_stat.st_mode & S_IWUSR) {
+	  disk->readonly = 0;
+	  flags = PROT_READ | PROT_WRITE;
+	} else {
+	  disk->readonly = 0x40;
+	  flags = PROT_READ;
+	}
+	if (writeback && !disk->readonly && (fd = open( name, O_RDWR)) >= 0) {
+	  disk->dsk = mmap( NULL, dsk_stat.st_size, flags, MAP_SHARED, fd, 0);
+	  disk->fd = fd;
+	} else {
+	  fd = open( name, O_RDONLY);
+	  disk->dsk = mmap( NULL, dsk_stat.st_size, flags, MAP_PRIVATE, fd, 0);
+	  close( fd);
+	}
+	if (disk->dsk == MAP_FAILED) {
+		printf( "disk image %s not mapped (errno. %d)\n", name, errno);
+		if (disk->fd >= 0)
+		  close( disk->fd);
+		disk->fd = -1;
+		disk->dsk = NULL;
+		return 0;
+	}
+	disk->size = dsk_stat.st_size;
+	return 1;
+}
+
+
+void disk_add( struct DiskList *l, int track, int side, int sector,
+		int32_t off, int len) {
+	if (l->n == l->max) {
+	  l->max = l->max ? 2 * l->max : 256;
+	  if ((l->ent = realloc( l->ent, l->max * sizeof( struct DiskEnt))) == NULL) {
+		fprintf( stderr, "Not enough memory for disk index\n");
+		abort();
+	  }
+	}
+	l->ent[l->n].track = track;
+	l->ent[l->n].side = side;
+	l->ent[l->n].sector = sector;
+	l->ent[l->n].len = len;
+	l->ent[l->n].off = off;
+	l->n++;
+}
+
+// index of the sectors by track, side and sector, the first one found
+// being kept if a sector is there twice. Returns 0 if there is no sector
+static int disk_index( struct Disk *disk, struct DiskList *l) {
+	struct DiskEnt *e;
+	int i, n, nids, *count;
+
+	disk->nbtrk = 0;
+	disk->sides = 1;
+	disk->firstsec = 255;
+	disk->lastsec = 0;
+	for (i = 0, e = l->ent; i < l->n; i++, e++) {
+	  if (e->off + e->len > disk->size)
+		continue;
+	  if (e->track > disk->nbtrk)
+		disk->nbtrk = e->track;
+	  if (e->side >= disk->sides)
+		disk->sides = e->side + 1;
+	  if (e->sector < disk->firstsec)
+		disk->firstsec = e->sector;
+	  if (e->sector > disk->lastsec)
+		disk->lastsec = e->sector;
+	}
+	if (disk->firstsec > disk->lastsec) {
+	  free( l->ent);
+	  return 0;
+	}
+
+	nids = disk->lastsec - disk->firstsec + 1;
+	n = (disk->nbtrk + 1) * disk->sides;
+	disk->sec = mmalloc( n * nids * sizeof( struct DiskSec));
+	for (i = 0; i < n * nids; i++)
+	  disk->sec[i].off = -1;
+	count = mmalloc( n * sizeof( int));
+	memset( count, 0, n * sizeof( int));
+	disk->nbsec = 0;
+	for (i = 0, e = l->ent; i < l->n; i++, e++) {
+	  struct DiskSec *sec = &disk->sec[(e->track * disk->sides + e->side) * nids
+		  + e->sector - disk->firstsec];
+	  if (e->off + e->len > disk->size || sec->off >= 0)
+		continue;
+	  sec->off = e->off;
+	  sec->len = e->len;
+	  if (++count[e->track * disk->sides + e->side] > disk->nbsec)
+		disk->nbsec = count[e->track * disk->sides + e->side];
+	}
+	free( count);
+	free( l->ent);
+	return 1;
+}
+
+// FLEX sectors in order, track after track
+static void disk_linear( struct DiskList *l, int nbtrk, int nbsec) {
+	int t, s;
+
+	for (t = 0; t <= nbtrk; t++)
+	  for (s = 0; s < nbsec; s++)
+		disk_add( l, t, 0, s + 1, (t * nbsec + s) * DISK_SECSIZE, DISK_SECSIZE);
+}
+
+// FLEX : geometry from the system information record (0x226 and 0x227),
+// as long as the file goes
+static int disk_flex( struct Disk *disk, struct DiskList *l, char *name) {
+	if (disk->size < 0x300 || disk->dsk[0x227] == 0) {
+	  printf( "%s: no FLEX geometry, give it as %s@<tracks>x<sides>x<sectors>\n",
+		  name, name);
+	  return 0;
+	}
+	disk_linear( l, disk->dsk[0x226], disk->dsk[0x227]);
+	return 1;
+}
+
+// DSK : plain sectors of the geometry given, numbered from 1, side after
+// side on each track
+static int disk_raw( struct Disk *disk, struct DiskList *l, char *geom) {
+	int t, h, s, nbtrk, sides, nbsec, len = DISK_SECSIZE;
+	int32_t off = 0;
+
+	if (sscanf( geom, "%dx%dx%dx%d", &nbtrk, &sides, &nbsec, &len) < 3
+		|| nbtrk < 1 || nbtrk > 256 || sides < 1 || sides > 2 || nbsec < 1
+		|| nbsec > 255 || (len != 128 && len != 256 && len != 512 && len != 1024)) {
+	  printf( "geometry <tracks>x<sides>x<sectors>[x<size>], not '%s'\n", geom);
+	  return 0;
+	}
+	for (t = 0; t < nbtrk; t++)
+	  for (h = 0; h < sides; h++)
+		for (s = 0; s < nbsec; s++, off += len)
+		  disk_add( l, t, h, s + 1, off, len);
+	return 1;
+}
+
+// JV1 : TRS-80 single sided images, 10 sectors of 256 bytes numbered from 0
+static int disk_jv1( struct Disk *disk, struct DiskList *l, char *name) {
+	int t, s;
+
+	for (t = 0; t < disk->size / 2560 && t < 256; t++)
+	  for (s = 0; s < 10; s++)
+		disk_add( l, t, 0, s, (t * 10 + s) * DISK_SECSIZE, DISK_SECSIZE);
+	return 1;
+}
+
+#define JV3_ENTRIES 2901
+#define JV3_DATA (JV3_ENTRIES * 3 + 1)	// after the headers and protect byte
+
+// JV3 : a header of track, sector and flags for each sector in the file,
+// the sectors following in the same order. Only the first header block
+// is read
+static int disk_jv3( struct Disk *disk, struct DiskList *l, char *name) {
+	static const int used[4] = { 256, 128, 1024, 512 };
+	static const int unused[4] = { 512, 1024, 128, 256 };
+	uint8_t *h = disk->dsk;
+	int32_t off = JV3_DATA;
+	int i, len;
+
+	if (disk->size < JV3_DATA) {
+	  printf( "%s: no JV3 header\n", name);
+	  return 0;
+	}
+	if (h[JV3_DATA - 1] == 0)
+	  disk->readonly = 0x40;
+	for (i = 0; i < JV3_ENTRIES && off < disk->size; i++, h += 3, off += len) {
+	  if (h[0] == 0xFF) {	// free sector
+		len = unused[h[2] & 0x03];
+		continue;
+	  }
+	  len = used[h[2] & 0x03];
+	  disk_add( l, h[0], (h[2] >> 4) & 1, h[1], off, len);
+	}
+	return 1;
+}
+
+// DMK : raw tracks behind a table of the ID address marks. The data of a
+// sector follows its data address mark, single density sectors with their
+// bytes doubled can't be used in place and are left out
+static int disk_dmk( struct Disk *disk, struct DiskList *l, char *name) {
+	uint8_t *h = disk->dsk, *trk, *p;
+	int ntrk = h[1], tlen = h[2] | h[3] << 8, sides = (h[4] & 0x10) ? 1 : 2;
+	int t, s, i, n, idam, len, doubled = 0;
+
+	if (tlen <= 128 || 16 + (size_t)ntrk * sides * tlen > disk->size) {
+	  printf( "%s: not a DMK image\n", name);
+	  return 0;
+	}
+	if (h[0] == 0xFF)
+	  disk->readonly = 0x40;
+	for (t = 0; t < ntrk; t++)
+	  for (s = 0; s < sides; s++) {
+		trk = h + 16 + (t * sides + s) * tlen;
+		for (i = 0; i < 64; i++) {
+		  if ((idam = trk[2*i] | trk[2*i+1] << 8) == 0)
+			break;
+		  if (!(idam & 0x8000) && !(h[4] & 0xC0)) {
+			doubled++;
+			continue;
+		  }
+		  idam &= 0x3FFF;
+		  p = trk + idam;
+		  if (idam < 128 || idam + 7 > tlen || p[0] != 0xFE)
+			continue;
+		  for (n = 7; n < 64 && idam + n < tlen; n++)
+			if (p[n] >= 0xF8 && p[n] <= 0xFB)
+			  break;
+		  len = 128 << (p[4] & 0x03);
+		  if (n == 64 || idam + n + 1 + len > tlen)
+			continue;
+		  disk_add( l, t, s, p[3], p + n + 1 - h, len);
+		}
+	  }
+	if (doubled)
+	  printf( "%s: %d single density sectors left out\n", name, doubled);
+	return 1;
+}
+
+// IMD : tracks of sectors, some compressed to one byte, so the image is
+// expanded into memory and can't be written back
+static int disk_imd( struct Disk *disk, struct DiskList *l, char *name) {
+	uint8_t *p, *end = disk->dsk + disk->size, *img = NULL;
+	uint8_t *smap, *cmap, *hmap;
+	int32_t off;
+	int pass, i, nsec, cyl, head, len, type;
+
+	for (pass = 0; pass < 2; pass++) {
+	  if ((p = memchr( disk->dsk, 0x1A, disk->size)) == NULL) {
+		printf( "%s: no IMD header\n", name);
+		return 0;
+	  }
+	  for (p++, off = 0; p + 5 <= end; ) {
+		cyl = p[1];
+		head = p[2];
+		nsec = p[3];
+		if (p[4] > 3) {
+		  printf( "%s: IMD sector size %d not supported\n", name, p[4]);
+		  return 0;
+		}
+		len = 128 << p[4];
+		smap = p + 5;
+		p = smap + nsec;
+		cmap = (head & 0x80) ? p : NULL;
+		p += cmap ? nsec : 0;
+		hmap = (head & 0x40) ? p : NULL;
+		p += hmap ? nsec : 0;
+		if (p > end)
+		  break;
+		for (i = 0; i < nsec && p < end; i++) {
+		  if ((type = *p++) == 0)	// no data
+			continue;
+		  if (type > 8 || ((type & 1) && p + len > end)) {
+			printf( "%s: bad IMD sector record\n", name);
+			return 0;
+		  }
+		  if (img != NULL) {
+			if (type & 1)
+			  memcpy( img + off, p, len);
+			else
+			  memset( img + off, *p, len);
+			disk_add( l, cmap ? cmap[i] : cyl, hmap ? hmap[i] & 1 : head & 1,
+				smap[i], off, len);
+		  }
+		  p += (type & 1) ? len : 1;
+		  off += len;
+		}
+	  }
+	  if (pass == 0)
+		img = mmalloc( off ? off : 1);
+	}
+
+	munmap( disk->dsk, disk->size);
+	if (disk->fd >= 0) {
+	  printf( "%s: IMD images are not written back\n", name);
+	  close( disk->fd);
+	  disk->fd = -1;
+	}
+	disk->dsk = img;
+	disk->size = off;
+	disk->copy = 1;
+	return 1;
+}
+
+// sectors of a mapped image, from its format
+static int disk_format( struct Disk *disk, struct DiskList *l, char *name, char *geom) {
+	char *ext = strrchr( name, '.');
+
+	if (geom != NULL) {
+	  disk->format = "DSK";
+	  return disk_raw( disk, l, geom);
+	} else if (ext != NULL && strcasecmp( ext, ".jv1") == 0) {
+	  disk->format = "JV1";
+	  return disk_jv1( disk, l, name);
+	} else if (ext != NULL && strcasecmp( ext, ".jv3") == 0) {
+	  disk->format = "JV3";
+	  return disk_jv3( disk, l, name);
+	} else if (ext != NULL && strcasecmp( ext, ".dmk") == 0) {
+	  disk->format = "DMK";
+	  return disk_dmk( disk, l, name);
+	} else if (ext != NULL && strcasecmp( ext, ".imd") == 0) {
+	  disk->format = "IMD";
+	  return disk_imd( disk, l, name);
+	} else if (ext != NULL && strcasecmp( ext, ".dsz") == 0) {
+	  disk->format = "compressed";
+	  return dsz_mount( disk, l, name);
+	}
+	disk->format = "FLEX";
+	return disk_flex( disk, l, name);
+}
+
+// overlays keep sectors of DISK_SECSIZE bytes in place in a mapped image
+static int disk_overlayable( struct Disk *disk) {
+	int i, n = (disk->nbtrk + 1) * disk->sides * (disk->lastsec - disk->firstsec + 1);
+
+	if (disk->copy || disk->dsz != NULL)
+	  return 0;
+	for (i = 0; i < n; i++)
+	  if (disk->sec[i].off >= 0
+		  && (disk->sec[i].len != DISK_SECSIZE || disk->sec[i].off % DISK_SECSIZE))
+		return 0;
+	return 1;
+}
+
+static void disk_unmount( struct Disk *disk) {
+	if (disk->dsz != NULL)
+	  dsz_unmount( disk);	// disk->dsk is in there
+	else if (disk->copy)
+	  free( disk->dsk);
+	else if (disk->dsk != NULL)
+	  munmap( disk->dsk, disk->size);
+	if (disk->fd >= 0)
+	  close( disk->fd);
+	free( disk->sec);
+	disk->sec = NULL;
+	disk->fd = -1;
+	disk->dsk = NULL;
+	disk->readonly = 0x80;
+}
+
+// label of a FLEX disk, in its system information record (track 0 sector 3)
+static void disk_label( struct Disk *disk) {
+	uint8_t *sir;
+	int32_t off;
+	int i, len;
+
+	if (disk->dir != NULL)
+	  return;	// named after the directory, nothing read before an access
+	disk->label[0] = 0;
+	if ((off = disk_sector( disk, 0, 0, 3, &len)) < 0 || len < DISK_SECSIZE)
+	  return;
+	sir = disk_data( disk, off, len, 0);
+	for (i = 0; i < 8 && sir[0x10+i] >= ' ' && sir[0x10+i] < 0x7F; i++)
+	  disk->label[i] = sir[0x10+i];
+	disk->label[i] = 0;
+}
+
+// mount an image, or an overlay "base+delta", returns 0 on error. The
+// format comes from the extension : .jv1, .jv3, .dmk, .imd, else FLEX,
+// or a plain DSK if the geometry is given as "name@<tracks>x<sides>x<sectors>".
+// A directory is a FLEX disk of its files
+int disk_mount( struct Disk *disk, char *name, int mode) {
+	static int exit_set = 0;
+	struct DiskList list = { NULL, 0, 0 };
+	struct stat st;
+	char buf[256], *delta, *geom;
+
+	memset( disk, 0, sizeof( struct Disk));
+	disk->fd = -1;
+	disk->readonly = 0x80;
+	disk->mode = mode;
+	strncpy( buf, name, 255);
+	buf[255] = 0;
+	if ((delta = strchr( buf, '+')) != NULL) {
+	  *delta++ = 0;
+	  disk->base = strdup( buf);
+	}
+	if ((geom = strchr( buf, '@')) != NULL)
+	  *geom++ = 0;
+	if (delta == NULL && stat( buf, &st) == 0 && S_ISDIR( st.st_mode)) {
+	  disk->format = "FLEX directory";
+	  if (!flexdir_mount( disk, buf, geom)) {
+		disk->readonly = 0x80;
+		return 0;
+	  }
+	  disk_linear( &list, disk->nbtrk, disk->nbsec);
+	} else {
+	  if (!disk_map( disk, buf, delta == NULL && (mode & DISK_WRITEBACK))) {
+		disk->readonly = 0x80;
+		return 0;
+	  }
+	  if (!disk_format( disk, &list, buf, geom)) {
+		free( list.ent);
+		disk_unmount( disk);
+		return 0;
+	  }
+	}
+	if (!disk_index( disk, &list)) {
+	  printf( "%s: no sector found\n", buf);
+	  disk_unmount( disk);
+	  return 0;
+	}
+
+	if (delta != NULL) {
+	  if (!disk_overlayable( disk)) {
+		printf( "%s: overlays need %d bytes sectors in a mapped image\n", buf, DISK_SECSIZE);
+		disk_unmount( disk);
+		return 0;
+	  }
+	  if (!disk_overlay( disk, delta)) {
+		disk_unmount( disk);
+		return 0;
+	  }
+	  disk->readonly = 0;	// written into the overlay
+	}
+	if (disk->fd >= 0) {
+	  disk->dirty = mmalloc( disk->size / DISK_SECSIZE / 8 + 1);
+	  memset( disk->dirty, 0, disk->size / DISK_SECSIZE / 8 + 1);
+	  disk->sync.run = disk_datasync;
+	  disk->sync.arg = disk;
+	}
+	disk_label( disk);
+
+	disk->next = disks;
+	disks = disk;
+	if (!exit_set) {
+	  atexit( disk_exit);
+	  exit_set = 1;
+	}
+	printf( "disk %s, %s, label '%s', %d tracks, %d side%s, %d sectors %s\n",
+		name, disk->format, disk->label, disk->nbtrk+1, disk->sides,
+		disk->sides > 1 ? "s" : "", disk->nbsec,
+		disk->readonly ? "(READONLY)" : disk->delta != NULL ? "(OVERLAY)"
+		: disk->fd >= 0 || (disk->dir != NULL && (mode & DISK_WRITEBACK))
+		? "(WRITEBACK)" : "");
+	return 1;
+}
@@ -0,0 +1,368 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4:
+   dsz.c -- compressed disk images
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "../emu/config.h"
+#include "../emu/emu6809.h"
+#include "hardware.h"
+
+/*
+   A .dsz image holds each track (each side of a track) of a disk compressed
+   on its own, after a header, a bitmap of the sectors there and the offset
+   of each track in the file :
+     header | bitmap | uint32 offset[ntracks + 1] | tracks
+   A track is stored as is when it doesn't get smaller. The codec is a
+   LZ77 of the LZ4 family : a token of the literal length (4 high bits) and
+   match length - 4 (4 low bits), each extended by bytes while 255, the
+   literals, then a 16 bits offset back into the track, the last sequence
+   having only literals.
+   The image is mapped and nothing is read at mount. A track is decompressed
+   at its first access into a cache of DSZ_CACHE tracks, the least recently
+   used one being replaced. The disk is write protected.
+   sim6809 -z <image> <image.dsz> builds one from any image mounted by
+   the fd1795.
+*/
+
+#define DSZ_MAGIC "S6809DSZ"
+#define DSZ_CACHE 8			// tracks decompressed
+#define DSZ_HASH 4096
+
+struct DszHeader {
+	char magic[8];
+	uint8_t nbtrk;			// last track
+	uint8_t sides;
+	uint8_t firstsec;
+	uint8_t lastsec;
+	uint16_t seclen;
+	uint16_t nbsec;			// most sectors on a track side
+	uint32_t ntracks;		// (nbtrk + 1) * sides
+};
+
+struct DszTrack {
+	int32_t track;			// -1 if free
+	uint8_t *data;
+	unsigned long used;		// time of the last access
+};
+
+struct Dsz {
+	uint8_t *map;			// compressed image
+	size_t maplen;
+	uint32_t *offset;
+	int32_t tracklen;		// bytes of a track decompressed
+	int16_t *slot;			// cache slot of each track, -1 if none
+	struct DszTrack *cache;
+	int ncache;
+	unsigned long clock;
+};
+
+static void dsz_emitlen( uint8_t **op, int n) {
+	for (; n >= 255; n -= 255)
+	  *(*op)++ = 255;
+	*(*op)++ = n;
+}
+
+// a sequence of literals then a match of mlen bytes (none if 0)
+static void dsz_emit( uint8_t **op, const uint8_t *lit, int nlit, int off, int mlen) {
+	int m = mlen ? mlen - 4 : 0;
+
+	*(*op)++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+	if (nlit >= 15)
+	  dsz_emitlen( op, nlit - 15);
+	memcpy( *op, lit, nlit);
+	*op += nlit;
+	if (mlen == 0)
+	  return;
+	*(*op)++ = off;
+	*(*op)++ = off >> 8;
+	if (m >= 15)
+	  dsz_emitlen( op, m - 15);
+}
+
+// compress len bytes of src into dst, of at least len + len / 255 + 16
+// bytes, returns the compressed length
+static int dsz_pack( const uint8_t *src, int len, uint8_t *dst) {
+	int table[DSZ_HASH], ip = 0, anchor = 0, ref, h, mlen;
+	uint8_t *op = dst;
+
+	memset( table, -1, sizeof( table));
+	while (ip + 4 <= len) {
+	  h = ((src[ip] | src[ip+1] << 8 | src[ip+2] << 16 | (uint32_t)src[ip+3] << 24)
+		  * 2654435761u) >> 20 & (DSZ_HASH - 1);
+	  ref = table[h];
+	  table[h] = ip;
+	  if (ref < 0 || ip - ref > 0xFFFF || memcmp( src + ref, src + ip, 4) != 0) {
+		ip++;
+		continue;
+	  }
+	  for (mlen = 4; ip + mlen < len && src[ref+mlen] == src[ip+mlen]; mlen++)
+		;
+	  dsz_emit( &op, src + anchor, ip - anchor, ip - ref, mlen);
+	  ip += mlen;
+	  anchor = ip;
+	}
+	dsz_emit( &op, src + anchor, len - anchor, 0, 0);
+	return op - dst;
+}
+
+static int dsz_getlen( const uint8_t **ip, const uint8_t *end, int n) {
+	if (n < 15)
+	  return n;
+	while (*ip < end) {
+	  n += **ip;
+	  if (*(*ip)++ != 255)
+		return n;
+	}
+	return -1;
+}
+
+// decompress clen bytes of src into len bytes of dst, returns 0 on error
+static int dsz_unpack( const uint8_t *src, int clen, uint8_t *dst, int len) {
+	const uint8_t *ip = src, *end = src + clen;
+	int op = 0, nlit, mlen, off, token;
+
+	while (ip < end) {
+	  token = *ip++;
+	  if ((nlit = dsz_getlen( &ip, end, token >> 4)) < 0
+		  || nlit > end - ip || nlit > len - op)
+		return 0;
+	  memcpy( dst + op, ip, nlit);
+	  ip += nlit;
+	  op += nlit;
+	  if (ip == end)
+		break;
+	  if (end - ip < 2)
+		return 0;
+	  off = ip[0] | ip[1] << 8;
+	  ip += 2;
+	  if ((mlen = dsz_getlen( &ip, end, token & 0x0F)) < 0
+		  || off == 0 || off > op || (mlen += 4) > len - op)
+		return 0;
+	  for (; mlen > 0; mlen--, op++)	// may overlap
+		dst[op] = dst[op - off];
+	}
+	return op == len;
+}
+
+// cache slot of a track, decompressed if needed
+static struct DszTrack *dsz_track( struct Disk *disk, int32_t t) {
+	struct Dsz *z = disk->dsz;
+	struct DszTrack *c = NULL;
+	uint32_t clen;
+	int i;
+
+	if (z->slot[t] >= 0) {
+	  c = &z->cache[z->slot[t]];
+	  c->used = ++z->clock;
+	  return c;
+	}
+	for (i = 0; i < z->ncache; i++) {	// free, else least recently used
+	  if (z->cache[i].track < 0) {
+		c = &z->cache[i];
+		break;
+	  }
+	  if (c == NULL || z->cache[i].used < c->used)
+		c = &z->cache[i];
+	}
+	if (c->track >= 0)
+	  z->slot[c->track] = -1;
+	c->track = t;
+	c->used = ++z->clock;
+	z->slot[t] = c - z->cache;
+
+	clen = z->offset[t+1] - z->offset[t];
+	if (clen == z->tracklen)
+	  memcpy( c->data, z->map + z->offset[t], clen);
+	else if (!dsz_unpack( z->map + z->offset[t], clen, c->data, z->tracklen)) {
+	  printf( "compressed track %d damaged\n", t);
+	  memset( c->data, 0, z->tracklen);
+	}
+	return c;
+}
+
+// data of the sector at off, never written as the disk is write protected
+uint8_t *dsz_data( struct Disk *disk, int32_t off, int write) {
+	struct Dsz *z = disk->dsz;
+	struct DszTrack *c = dsz_track( disk, off / z->tracklen);
+
+	return c->data + off % z->tracklen;
+}
+
+// the compressed image mapped at disk->dsk, its sectors by offset in the
+// tracks decompressed one after the other
+int dsz_mount( struct Disk *disk, struct DiskList *l, char *name) {
+	struct DszHeader h;
+	struct Dsz *z;
+	uint8_t *bitmap;
+	uint32_t t, nids, n, i;
+
+	memcpy( &h, disk->dsk, sizeof( h));	// mapped images are 32 bytes at least
+	if (memcmp( h.magic, DSZ_MAGIC, 8) != 0
+		|| h.ntracks != (uint32_t)(h.nbtrk + 1) * h.sides || h.lastsec < h.firstsec) {
+	  printf( "%s: not a compressed image\n", name);
+	  return 0;
+	}
+	nids = h.lastsec - h.firstsec + 1;
+	n = h.ntracks * nids;
+	bitmap = disk->dsk + sizeof( h);
+	if (sizeof( h) + (n + 7) / 8 + (h.ntracks + 1) * sizeof( uint32_t) > disk->size) {
+	  printf( "%s: truncated\n", name);
+	  return 0;
+	}
+
+	z = mmalloc( sizeof( struct Dsz));
+	z->map = disk->dsk;
+	z->maplen = disk->size;
+	z->offset = mmalloc( (h.ntracks + 1) * sizeof( uint32_t));
+	memcpy( z->offset, bitmap + (n + 7) / 8, (h.ntracks + 1) * sizeof( uint32_t));
+	for (t = 0; t < h.ntracks; t++)
+	  if (z->offset[t] > z->offset[t+1] || z->offset[t+1] > disk->size) {
+		printf( "%s: bad track index\n", name);
+		free( z->offset);
+		free( z);
+		return 0;
+	  }
+	z->tracklen = nids * h.seclen;
+	z->slot = mmalloc( h.ntracks * sizeof( int16_t));
+	memset( z->slot, -1, h.ntracks * sizeof( int16_t));
+	z->ncache = DSZ_CACHE;
+	z->cache = mmalloc( z->ncache * sizeof( struct DszTrack));
+	for (i = 0; i < z->ncache; i++) {
+	  z->cache[i].track = -1;
+	  z->cache[i].data = mmalloc( z->tracklen);
+	}
+	z->clock = 0;
+
+	for (i = 0; i < n; i++)
+	  if (bitmap[i >> 3] & (1 << (i & 7)))
+		disk_add( l, i / nids / h.sides, i / nids % h.sides, h.firstsec + i % nids,
+			i * h.seclen, h.seclen);
+	if (disk->fd >= 0) {
+	  printf( "%s: compressed images are not written back\n", name);
+	  close( disk->fd);
+	  disk->fd = -1;
+	}
+	disk->readonly = 0x40;	// no room for a track written
+	disk->dsz = z;
+	disk->dsk = NULL;	// sectors only through dsz_data()
+	disk->size = (size_t)h.ntracks * z->tracklen;
+	return 1;
+}
+
+// release the mapping and the cache, the disk being unmounted
+void dsz_unmount( struct Disk *disk) {
+	struct Dsz *z = disk->dsz;
+	int i;
+
+	munmap( z->map, z->maplen);
+	for (i = 0; i < z->ncache; i++)
+	  free( z->cache[i].data);
+	free( z->cache);
+	free( z->slot);
+	free( z->offset);
+	free( z);
+	disk->dsz = NULL;
+}
+
+// write image compressed into out, returns 0 on error
+int dsz_create( char *image, char *out) {
+	struct DszHeader h;
+	struct Disk *disk = mmalloc( sizeof( struct Disk));	// mounted until exit
+	uint8_t *bitmap, *track, *packed;
+	uint32_t *offset, t, nids, n, i;
+	int32_t off;
+	int s, len, seclen = 0, clen;
+	FILE *f;
+
+	if (!disk_mount( disk, image, 0))
+	  return 0;
+	memset( &h, 0, sizeof( h));
+	memcpy( h.magic, DSZ_MAGIC, 8);
+	h.nbtrk = disk->nbtrk;
+	h.sides = disk->sides;
+	h.firstsec = disk->firstsec;
+	h.lastsec = disk->lastsec;
+	h.nbsec = disk->nbsec;
+	h.ntracks = (disk->nbtrk + 1) * disk->sides;
+	nids = h.lastsec - h.firstsec + 1;
+	n = h.ntracks * nids;
+
+	bitmap = mmalloc( (n + 7) / 8);
+	memset( bitmap, 0, (n + 7) / 8);
+	for (i = 0; i < n; i++) {
+	  if (disk_sector( disk, i / nids / h.sides, i / nids % h.sides,
+		  h.firstsec + i % nids, &len) < 0)
+		continue;
+	  if (seclen && len != seclen) {
+		printf( "%s: sectors of %d and %d bytes can't be compressed together\n",
+			image, seclen, len);
+		free( bitmap);
+		return 0;
+	  }
+	  seclen = len;
+	  bitmap[i >> 3] |= 1 << (i & 7);
+	}
+	h.seclen = seclen;
+
+	if ((f = fopen( out, "wb")) == NULL) {
+	  printf( "Can't create %s\n", out);
+	  free( bitmap);
+	  return 0;
+	}
+	offset = mmalloc( (h.ntracks + 1) * sizeof( uint32_t));
+	track = mmalloc( nids * seclen);
+	packed = mmalloc( nids * seclen + nids * seclen / 255 + 16);
+	offset[0] = sizeof( h) + (n + 7) / 8 + (h.ntracks + 1) * sizeof( uint32_t);
+	fseek( f, offset[0], SEEK_SET);
+	for (t = 0; t < h.ntracks; t++) {
+	  memset( track, 0, nids * seclen);
+	  for (s = 0; s < nids; s++)
+		if ((off = disk_sector( disk, t / h.sides, t % h.sides, h.firstsec + s, &len)) >= 0)
+		  memcpy( track + s * seclen, disk_data( disk, off, len, 0), len);
+	  clen = dsz_pack( track, nids * seclen, packed);
+	  if (clen >= nids * seclen)
+		fwrite( track, clen = nids * seclen, 1, f);
+	  else
+		fwrite( packed, clen, 1, f);
+	  offset[t+1] = offset[t] + clen;
+	}
+	fseek( f, 0, SEEK_SET);
+	fwrite( &h, sizeof( h), 1, f);
+	fwrite( bitmap, (n + 7) / 8, 1, f);
+	fwrite( offset, sizeof( uint32_t), h.ntracks + 1, f);
+	free( packed);
+	free( track);
+	free( bitmap);
+	if (fclose( f) != 0) {
+	  printf( "Error writing %s\n", out);
+	  free( offset);
+	  return 0;
+	}
+	printf( "%s: %d tracks, %u bytes compressed into %u\n", out, h.ntracks,
+		h.ntracks * nids * seclen, offset[h.ntracks]);
+	free( offset);
+	return 1;
+}
@@ -52,14 +52,17 @@ void fake_reset( struct Device *dev) {
 }
 
 // Creation of fake device
-void fake_init( char* name, uint16_t adr, uint16_t end) {
+void fake_init( char* name, uint16_t adr, char *args) {
 	struct Device *new;
 	struct Fake *reg;
+	uint16_t end;
+
+	end = readhex( &args);
 
 	// Create a device and allocate space for data
 	new = mmalloc( sizeof( struct Device));
 	strcpy( new->devname, name);
-	new->type = FAKE;
+	new->ops = &fake_ops;
 	new->addr = adr;
 	if (end > adr) 	// end = 0 if not defined
 	  new->end = end;
@@ -70,8 +73,7 @@ void fake_init( char* name, uint16_t adr, uint16_t end) {
 	new->registers = reg;
 	reg->size = (uint16_t)(new->end - new->addr);
 	reg->byte = mmalloc( sizeof(uint8_t) * reg->size);
-	new->next = devices;
-	devices = new;
+	dev_add( new);
 	fake_reset( new);
 }
 
@@ -93,3 +95,8 @@ void fake_write( struct Device *dev, uint16_t adr, uint8_t val) {
   reg->byte[pos] = val;
   return;
 }
+
+const struct DevOps fake_ops = {
+	fake_init, fake_reset, fake_read, fake_write,
+	NULL, NULL, NULL
+};
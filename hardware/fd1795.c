@@ -16,13 +16,11 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
 
-#define _XOPEN_SOURCE
-
-#include <sys/stat.h>
-#include <sys/mman.h>
+#define _XOPEN_SOURCE 500			// fdatasync, msync
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -34,20 +32,271 @@
 #include "../emu/emu6809.h"
 #include "hardware.h"
 
+#define FDC_DRIVES 4
+#define FDC_FLUSHDELAY 1000000	// cycles between a write and its flush
+#define FDC_LOOPCYCLES 24		// cycles of a byte in a transfer loop
+#define FDC_RPM 300				// timed : rotation speed
+#define FDC_GAP 64				// bytes between two sectors
+#define FDC_SETTLE 15			// ms for the head to settle
+
+// timed : what happens at the deadline
+#define FDC_IDLE 0
+#define FDC_TYPE1 1				// end of a restore, seek or step
+#define FDC_SEARCH 2			// sector under the head, first DRQ
+#define FDC_BYTE 3				// next byte ready, DRQ
+#define FDC_END 4				// CRC passed, end of the sector
+
+/*
+   Drives 0 to 3 each get an image (see disk.c), the drive being selected
+   by a latch register outside the controller, as on SWTPC or Gimix boards :
+     bits 0-1 : drive number
+     bit 6    : side (kept for the images holding both sides)
+   Without latch, drive 0 is always selected.
+   Images are private copies unless "writeback" is given : they are then
+   mapped shared, and the sectors written are flushed in batches with
+   msync(MS_ASYNC), FDC_FLUSHDELAY cycles after the first write, on FORCE
+   INTERRUPT and at exit. "fsync" also has the data of each batch put on
+   disk by the I/O thread (see hostio.c); else this is only done at exit.
+   An image "base+delta" writes into the overlay delta, the base being only
+   read. "overlay discard" keeps what is written in memory only, "overlay
+   commit" writes it into the bases at exit.
+   With "fast", the usual polling loops of the disk drivers are recognised
+   when they move the first byte of a sector (x and y being A or B) :
+     L: LDx  <status>            L: LDx  <status>
+        BITx #$02                   BITx #$02
+        BEQ  done                   BEQ  done
+        LDy  <data>                 LDy  ,X+
+        STy  ,X+                    STy  <data>
+        BRA  L                      BRA  L
+   The whole sector is then moved at once, the registers and the cycles
+   being left as after the last byte, back at L. Interrupts and breakpoints
+   are not seen during the transfer.
+   Commands complete at once, unless "timed" is given : busy then stays
+   set while stepping at the rate of the command (6, 12, 20 or 30 ms), with
+   FDC_SETTLE ms more if asked, and until the sector passes under the head,
+   the disk turning at FDC_RPM. DRQ comes back a byte time after each byte
+   transfered and INTRQ is raised on the interrupt line at the end of each
+   command, until the status is read or the next command written. All these are deadlines in cycles, nothing is done in between.
+   Ex: fd1795 E018 IRQ latch E014 writeback flex.dsk work.dsk
+       fd1795 E018 FIRQ timed fast overlay commit system.dsk+run1.ovl
+       fd1795 E018 IRQ games.dmk cpm.imd data.dsk@80x2x9x512
+*/
+
 struct Fdc {
-	char label[16];
-	uint8_t *dsk;
 	uint8_t cr;
 	uint8_t sr;
 	uint8_t track;
 	uint8_t sector;
 	uint8_t data;
-	uint16_t pos;
+	uint8_t latch;			// drive select register
+	int8_t stepdir;
+	uint8_t head[FDC_DRIVES];	// track under the head of each drive
+	int32_t ptr;			// offset of the sector transfered, -1 if none
+	int16_t pos;			// next byte in the sector
+	int16_t len;			// bytes in the sector
+	uint8_t phase;			// timed : event at the deadline
+	int64_t due;			// timed : next event, LONG_MAX if none
+	uint8_t intrq;			// timed : INTRQ held until the status is read
+	// host side
+	uint8_t *buf;			// data of the sector transfered
+	struct Disk drive[FDC_DRIVES];
+	long flush;				// time to flush the sectors written
+	int fast;				// transfer loops recognised
+	int timed;				// commands take time
 };
 
-static uint8_t readonly, nbtrk, nbsec, *ptr, *end, track_id;
-static int fd;
-static int count, stepdir;
+// Latch register : a device of its own, on the same controller
+static uint8_t fdlatch_read( struct Device *dev, uint16_t reg);
+static void fdlatch_write( struct Device *dev, uint16_t reg, uint8_t val);
+static const struct DevOps fdlatch_ops = {
+	NULL, NULL, fdlatch_read, fdlatch_write,
+	NULL, NULL, NULL
+};
+
+// Partial implementation :
+// - no provision for track R/W
+// - the side is the U bit of the read and write commands
+
+static struct Disk *fdc_drive( struct Fdc *fdc) {
+	return &fdc->drive[fdc->latch & (FDC_DRIVES - 1)];
+}
+
+// status of a type I command : head loaded, track 0, protected, not ready
+static uint8_t fdc_status( struct Fdc *fdc) {
+	struct Disk *drv = fdc_drive( fdc);
+
+	return drv->readonly | (fdc->head[fdc->latch & (FDC_DRIVES - 1)] ? 0x20 : 0x24);
+}
+
+// offset of a sector on the side of the command, its length into len
+static int32_t fdc_sector( struct Fdc *fdc, int track, int sector) {
+	int32_t off;
+	int len = 0;
+
+	off = disk_sector( fdc_drive( fdc), track, (fdc->cr >> 1) & 1, sector, &len);
+	fdc->len = len;
+	return off;
+}
+
+static long fdc_ms( long ms) {
+	return ms * CPU_CLOCK / 1000;
+}
+
+// cycles between two bytes of a sector, 0 if not timed
+static long fdc_bytecycles( struct Fdc *fdc) {
+	struct Disk *drv = fdc_drive( fdc);
+
+	if (!fdc->timed || drv->nbsec == 0)
+	  return 0;
+	return fdc_ms( 60000 / FDC_RPM) / (drv->nbsec * (fdc->len + FDC_GAP));
+}
+
+// cycles from now before byte pos of the sector passes under the head,
+// looking from cycle from on
+static long fdc_latency( struct Fdc *fdc, int pos, long from) {
+	struct Disk *drv = fdc_drive( fdc);
+	long rev = fdc_ms( 60000 / FDC_RPM), at;
+
+	at = drv->nbsec ? rev * ((fdc->sector - drv->firstsec) % drv->nbsec) / drv->nbsec : 0;
+	at += pos * fdc_bytecycles( fdc);
+	return from - cycles + ((at - from % rev) % rev + rev) % rev;
+}
+
+// same within the sector : a byte already gone is not lost but ready now
+static long fdc_bytewait( struct Fdc *fdc, int pos) {
+	long n = fdc_latency( fdc, pos, cycles);
+
+	return n > fdc_ms( 60000 / FDC_RPM) / 2 ? 0 : n;
+}
+
+static void fdc_later( struct Fdc *fdc, int phase, long delay) {
+	fdc->phase = phase;
+	fdc->due = cycles + delay;
+	dev_deadline = 0;
+}
+
+// INTRQ stays up until the status is read or a command is written, the
+// interrupt being raised by fd1795_run meanwhile
+static void fdc_intrq( struct Device *dev) {
+	((struct Fdc *)dev->registers)->intrq = 1;
+	dev_deadline = 0;
+}
+
+// start the transfer of the sector at ptr, the flush being due some time
+// after the first sector written
+static void fdc_start( struct Fdc *fdc, long delay) {
+	struct Disk *drv = fdc_drive( fdc);
+
+	fdc->pos = 0;
+	fdc->buf = disk_data( drv, fdc->ptr, fdc->len, fdc->cr & 0x20);
+	if (drv->ndirty && fdc->flush == LONG_MAX) {
+	  fdc->flush = cycles + FDC_FLUSHDELAY;
+	  dev_deadline = 0;
+	}
+	if (fdc->timed) {
+	  fdc->sr = 0x01;	// busy, DRQ when the sector comes
+	  fdc_later( fdc, FDC_SEARCH, fdc_latency( fdc, 0, cycles + delay));
+	} else
+	  fdc->sr = 0x03;
+}
+
+// a restore, seek or step of steps tracks : busy until the head is there
+static void fdc_type1( struct Fdc *fdc, int steps) {
+	static const int rate[4] = { 6, 12, 20, 30 };	// ms
+
+	fdc->sr = fdc_status( fdc);
+	if (!fdc->timed)
+	  return;
+	fdc->sr |= 0x01;
+	fdc_later( fdc, FDC_TYPE1, steps * fdc_ms( rate[fdc->cr & 0x03])
+		+ ((fdc->cr & 0x04) ? fdc_ms( FDC_SETTLE) : 0));
+}
+
+// instruction at adr with an extended operand, opa being the opcode for
+// register A : returns the register 'A' or 'B' used, 0 if not this one
+static int fdc_op( uint16_t adr, uint8_t opa, uint16_t operand) {
+	uint8_t op = get_memb( adr);
+
+	if (get_memw( adr+1) != operand)
+	  return 0;
+	return op == opa ? 'A' : op == (opa | 0x40) ? 'B' : 0;
+}
+
+// polling of DRQ at l : LDx <status>, BITx #$02, BEQ
+static int fdc_poll( struct Device *dev, uint16_t l) {
+	int r = fdc_op( l, 0xB6, dev->addr);
+
+	return r && get_memb( l+3) == (r == 'A' ? 0x85 : 0xC5)
+		&& get_memb( l+4) == 0x02 && get_memb( l+5) == 0x27;
+}
+
+// cycles of a byte in a transfer loop, waiting for DRQ if timed
+static long fdc_loopcycles( struct Fdc *fdc) {
+	long n = fdc_bytecycles( fdc);
+
+	return n > FDC_LOOPCYCLES ? n : FDC_LOOPCYCLES;
+}
+
+// first byte read by LDy <data>, rpc being on the STy ,X+ that follows :
+// copy the sector to X, returns 0 if this is not the read loop
+static int fdc_fastread( struct Device *dev, struct Fdc *fdc) {
+	uint16_t pc = rpc, l;
+	int r, i;
+
+	r = fdc_op( pc-3, 0xB6, dev->addr+3);
+	if (!r || get_memb( pc) != (r == 'A' ? 0xA7 : 0xE7)
+		|| get_memb( pc+1) != 0x80 || get_memb( pc+2) != 0x20)
+	  return 0;
+	l = pc + 4 + (int8_t)get_memb( pc+3);
+	if ((uint16_t)(l + 7) != (uint16_t)(pc - 3) || !fdc_poll( dev, l))
+	  return 0;
+	for (i = 0; i < fdc->len; i++)
+	  set_memb( rx++, fdc->buf[i]);
+	rpc = l;	// the last byte is loaded on return
+	cycles += 9 + (fdc->len - 1) * fdc_loopcycles( fdc);
+	return 1;
+}
+
+// first byte written by STy <data>, rpc being on the BRA that follows :
+// copy the sector from X, returns 0 if this is not the write loop
+static int fdc_fastwrite( struct Device *dev, struct Fdc *fdc, uint8_t val) {
+	uint16_t pc = rpc, l;
+	uint8_t last, cc;
+	int r, i;
+
+	r = fdc_op( pc-3, 0xB7, dev->addr+3);
+	if (!r || get_memb( pc-5) != (r == 'A' ? 0xA6 : 0xE6)
+		|| get_memb( pc-4) != 0x80 || get_memb( pc) != 0x20)
+	  return 0;
+	l = pc + 2 + (int8_t)get_memb( pc+1);
+	if ((uint16_t)(l + 7) != (uint16_t)(pc - 5) || !fdc_poll( dev, l))
+	  return 0;
+	fdc->buf[0] = val;
+	for (i = 1; i < fdc->len; i++)
+	  fdc->buf[i] = get_memb( rx++);
+	last = fdc->buf[fdc->len - 1];
+	if (r == 'A')
+	  ra = last;
+	else
+	  rb = last;
+	cc = getcc() & ~0x0E;	// N, Z and V of the last STy
+	if (last & 0x80)
+	  cc |= 0x08;
+	if (last == 0)
+	  cc |= 0x04;
+	setcc( cc);
+	rpc = l;
+	cycles += 3 + (fdc->len - 1) * fdc_loopcycles( fdc);
+	return 1;
+}
+
+static void fdc_flush( struct Fdc *fdc) {
+	int n;
+
+	fdc->flush = LONG_MAX;
+	for (n = 0; n < FDC_DRIVES; n++)
+	  disk_flush( &fdc->drive[n], 0);
+}
 
 // Initialisation at reset
 void fd1795_reset( struct Device *dev) {
@@ -55,188 +304,255 @@ void fd1795_reset( struct Device *dev) {
 	
 	fdc = dev->registers;
 	fdc->cr = 0;
-	fdc->sr = readonly;
 	fdc->track = 0;
 	fdc->sector = 0;
 	fdc->data = 0;
-	fdc->pos = 0;
+	fdc->latch = 0;
+	fdc->stepdir = 1;
+	memset( fdc->head, 0, FDC_DRIVES);
+	fdc->ptr = -1;
+	fdc->phase = FDC_IDLE;
+	fdc->due = LONG_MAX;
+	fdc->intrq = 0;
+	fdc->sr = fdc_status( fdc);
 }
 
-// Partial implementation :
-// - only one disk supported (no provision for drive select)
-// - no provision for track R/W
-// - blocs are only 256 bytes
-// - guessing number of tracks/sectors from file size may fail...
-
 // Creation of Floppy Controler
-void fd1795_init( char* name, uint16_t adr, char int_line, char *dskname) {
-	struct Device *new;
+// fd1795 <adr> [IRQ|FIRQ|NMI] [latch <adr>] [timed] [fast] [writeback] [fsync]
+//        [overlay keep|discard|commit] <image drive 0> [<image drive 1> ...]
+void fd1795_init( char* name, uint16_t adr, char *args) {
+	struct Device *new, *latch;
 	struct Fdc *fdc;
-	struct stat dsk_stat;
-	int flags;
+	char int_line, *dskname;
+	int n, mode = 0;
+
+	int_line = read_intline( &args);
 
 	// Create a device and map data in memory
 	new = mmalloc( sizeof( struct Device));
 	strcpy( new->devname, name);
-	new->type = FD1795;
+	new->ops = &fd1795_ops;
 	new->addr = adr;
 	new->end = adr+4;
 	new->interrupt = int_line;
 	fdc = mmalloc( sizeof( struct Fdc));
+	memset( fdc, 0, sizeof( struct Fdc));
 	new->registers = fdc;
-	new->next = devices;
-	devices = new;
-
-	if (stat( dskname, &dsk_stat)) {
-		printf( "disk image %s unreachable\n");
-		readonly = 0x80;
-	} else {
-	  if (dsk_stat.st_mode & S_IWUSR) {
-		readonly = 0;
-		fd = open( dskname, O_RDONLY);
-		flags = PROT_READ | PROT_WRITE;
-	  } else {
-		readonly = 0x40;
-		fd = open( dskname, O_RDONLY);
-		flags = PROT_READ;
+	fdc->flush = LONG_MAX;
+	dev_add( new);
+
+	for (;;) {
+	  dskname = readstr( &args);
+	  if (strcmp( dskname, "latch") == 0) {
+		latch = mmalloc( sizeof( struct Device));
+		strcpy( latch->devname, "FDLATCH");
+		latch->ops = &fdlatch_ops;
+		latch->addr = readhex( &args);
+		latch->end = latch->addr+1;
+		latch->interrupt = 'X';
+		latch->registers = fdc;
+		dev_add( latch);
+	  } else if (strcmp( dskname, "timed") == 0)
+		fdc->timed = 1;
+	  else if (strcmp( dskname, "fast") == 0)
+		fdc->fast = 1;
+	  else if (strcmp( dskname, "writeback") == 0)
+		mode |= DISK_WRITEBACK;
+	  else if (strcmp( dskname, "fsync") == 0)
+		mode |= DISK_FSYNC;
+	  else if (strcmp( dskname, "overlay") == 0) {
+		dskname = readstr( &args);
+		if (strcmp( dskname, "discard") == 0)
+		  mode |= DISK_DISCARD;
+		else if (strcmp( dskname, "commit") == 0)
+		  mode |= DISK_COMMIT;
+		else if (strcmp( dskname, "keep") != 0)
+		  printf( "overlay keep, discard or commit, not '%s'\n", dskname);
+	  } else
+		break;
+	}
+	for (n = 0; n < FDC_DRIVES; n++) {
+	  fdc->drive[n].readonly = 0x80;
+	  fdc->drive[n].fd = -1;
+	  if (*dskname && *dskname != '#') {
+		disk_mount( &fdc->drive[n], dskname, mode);
+		dskname = readstr( &args);
 	  }
-	  fdc->dsk = NULL;
-	  fdc->dsk = mmap( &fdc->dsk, dsk_stat.st_size, flags, MAP_PRIVATE, fd, 0);
-	  nbtrk = fdc->dsk[0x226];
-	  nbsec = fdc->dsk[0x227];
-	  for (int i=0; i<8; i++)
-	    fdc->label[i] = fdc->dsk[i+0x210];
-	  fdc->label[8] = 0;
-	  printf( "disk %s, label '%s', %d tracks, %d sectors %s\n",
-	  	dskname, fdc->label, nbtrk+1, nbsec, readonly?"(READONLY)":"");
 	}
 	fd1795_reset( new);
 }
 
+// end of a sector transfer : go on with the next sector of a multiple
+// command, else clear busy and DRQ
+static void fdc_next( struct Device *dev, struct Fdc *fdc) {
+	if (fdc->cr & 0x10) {
+	  fdc->ptr = fdc_sector( fdc, fdc->head[fdc->latch & (FDC_DRIVES - 1)], ++fdc->sector);
+	  if (fdc->ptr >= 0) {
+		fdc_start( fdc, 0);
+		return;
+	  }
+	}
+	fdc->ptr = -1;
+	fdc->sr &= 0xFC;
+	if (fdc->timed)
+	  fdc_intrq( dev);
+}
+
+// a byte was transfered : DRQ comes back for the next one, or the sector
+// ends after its CRC
+static void fdc_byte( struct Device *dev, struct Fdc *fdc) {
+	if (!fdc->timed) {
+	  if (fdc->pos == fdc->len)
+		fdc_next( dev, fdc);
+	  return;
+	}
+	fdc->sr &= 0xFD;
+	if (fdc->pos < fdc->len)
+	  fdc_later( fdc, FDC_BYTE, fdc_bytewait( fdc, fdc->pos));
+	else	// after the CRC
+	  fdc_later( fdc, FDC_END, fdc_bytewait( fdc, fdc->len + 2));
+}
+
+// timed : the deadline is there
+static void fdc_event( struct Device *dev, struct Fdc *fdc) {
+	int phase = fdc->phase;
+
+	fdc->phase = FDC_IDLE;
+	fdc->due = LONG_MAX;
+	switch (phase) {
+	  case FDC_TYPE1:
+		fdc->sr &= 0xFE;
+		fdc_intrq( dev);
+		break;
+	  case FDC_SEARCH:
+	  case FDC_BYTE:
+		fdc->sr |= 0x02;
+		break;
+	  case FDC_END:
+		fdc_next( dev, fdc);
+		break;
+	}
+}
+
 // handle reads from Floppy Controler registers
 uint8_t fd1795_read( struct Device *dev, uint16_t reg) {
   struct Fdc *fdc;
-  uint8_t buf;
   fdc = dev->registers;
   switch( reg & 0x03) {
 	case 0x00 :
+	  fdc->intrq = 0;
 	  return fdc->sr;
 	case 0x01 :
 	  return fdc->track;
 	case 0x02 :
 	  return fdc->sector;
 	case 0x03 :
-	  if (ptr != NULL && ptr < end)
-	    fdc->data = *ptr++; 
-	  if (ptr == end)
-	    fdc->sr &= 0xFC;
+	  if (fdc->ptr >= 0 && (fdc->sr & 0x02)) {
+		if (fdc->pos == 0 && fdc->fast && fdc_fastread( dev, fdc))
+		  fdc->pos = fdc->len - 1;
+	    fdc->data = fdc->buf[fdc->pos++];
+		fdc_byte( dev, fdc);
+	  }
 	  return fdc->data;
   }
+  return 0xff;
 }
 
 // handle writes to Floppy Controler Registers
 void fd1795_write( struct Device *dev, uint16_t reg, uint8_t val) {
   struct Fdc *fdc;
-  uint8_t cmd;
+  struct Disk *drv;
+  uint8_t cmd, old, *track_id;
 
   fdc = dev->registers;
+  drv = fdc_drive( fdc);
+  track_id = &fdc->head[fdc->latch & (FDC_DRIVES - 1)];
   switch( reg & 0x03) {
 	case 0x00 :
 	  fdc->cr = val;
 	  cmd = val & 0xf0;
+	  fdc->ptr = -1;
+	  fdc->phase = FDC_IDLE;
+	  fdc->due = LONG_MAX;
+	  fdc->intrq = 0;
+	  old = *track_id;
 	  switch (cmd) {
 	    case 0x00:		// Restore
-		  track_id = fdc->track = 0;
-		  fdc->sr = readonly & 0x24;
-		  ptr = NULL;
+		  *track_id = fdc->track = 0;
+		  fdc_type1( fdc, old);
 		  break;
 		case 0x10:	// SEEK
-		  if (fdc->data > nbtrk)
-		  	track_id = fdc->track = nbtrk;
+		  if (fdc->data > drv->nbtrk)
+		  	*track_id = fdc->track = drv->nbtrk;
 		  else
-		  	track_id = fdc->track = fdc->data;
-		  if (track_id)
-		    fdc->sr = readonly & 0x20;
-		  else
-		    fdc->sr = readonly & 0x24;
-		  ptr = NULL;
+		  	*track_id = fdc->track = fdc->data;
+		  fdc_type1( fdc, abs( *track_id - old));
 		  break;
 		case 0x30:	// STEP
-		  fdc->track += stepdir;
-		  if (fdc->track > nbtrk)
-			fdc->track = nbtrk;
+		  fdc->track += fdc->stepdir;
+		  if (fdc->track > drv->nbtrk)
+			fdc->track = drv->nbtrk;
 		  if (fdc->track == 0xff)
 			fdc->track = 0;
 		case 0x20:	// id, but no track register update
-		  track_id += stepdir;
-		  if (track_id > nbtrk)
-			track_id = nbtrk;
-		  if (track_id == 0xff)
-			track_id = 0;
-		  if (track_id)
-		    fdc->sr = readonly & 0x20;
-		  else
-		    fdc->sr = readonly & 0x24;
-		  ptr = NULL;
+		  *track_id += fdc->stepdir;
+		  if (*track_id > drv->nbtrk)
+			*track_id = drv->nbtrk;
+		  if (*track_id == 0xff)
+			*track_id = 0;
+		  fdc_type1( fdc, 1);
 		  break;
 		case 0x50:	// STEP IN  // @TODO verify range
-		  if (fdc->track <= nbtrk)
+		  if (fdc->track <= drv->nbtrk)
 		    fdc->track++;
 		case 0x40:	// id, but no track register update
-		  stepdir = 1;
-		  if (track_id <= nbtrk)
-		    track_id++;
-		  fdc->sr = readonly & 0x20;
-		  ptr = NULL;
+		  fdc->stepdir = 1;
+		  if (*track_id <= drv->nbtrk)
+		    (*track_id)++;
+		  fdc_type1( fdc, 1);
 		  break;
 		case 0x70:	// STEP OUT  // @TODO verify range
 		  if (fdc->track)
 		    fdc->track--;
 		case 0x60:	// id, but no track register update
-		  stepdir = -1;
-		  if (track_id)
-		    track_id--;
-		  if (track_id)
-		    fdc->sr = readonly & 0x20;
-		  else
-		    fdc->sr = readonly & 0x24;
-		  ptr = NULL;
+		  fdc->stepdir = -1;
+		  if (*track_id)
+		    (*track_id)--;
+		  fdc_type1( fdc, 1);
 		  break;
 		case 0x80:	// READ SECTOR
-		  ptr = fdc->dsk + (track_id * nbsec + fdc->sector - 1) * 256;
-		  end = ptr + 256;
-		  fdc->sr |= 0x03;
-		  break;
 		case 0x90:	// READ MULTIPLE
-		  ptr = fdc->dsk + (track_id * nbsec + fdc->sector - 1) * 256;
-		  end = fdc->dsk + (track_id + 1) * 256;
-		  fdc->sr |= 0x03;
-		  break;
 		case 0xA0:	// WRITE SECTOR
-		  ptr = fdc->dsk + (track_id * nbsec + fdc->sector - 1) * 256;
-		  end = ptr + 256;
-		  fdc->sr |= 0x03;
-		  break;
 		case 0xB0:	// WRITE MULTIPLE
-		  ptr = fdc->dsk + (track_id * nbsec + fdc->sector - 1) * 256;
-		  end = fdc->dsk + (track_id + 1) * 256;
-		  fdc->sr |= 0x03;
+		  if (drv->readonly & 0x80) {
+			fdc->sr = 0x80;		// not ready
+			break;
+		  }
+		  if ((cmd & 0x20) && (drv->readonly & 0x40)) {
+			fdc->sr = 0x40;		// write protect
+			break;
+		  }
+		  if ((fdc->ptr = fdc_sector( fdc, *track_id, fdc->sector)) < 0) {
+			fdc->sr = 0x10;		// record not found
+			break;
+		  }
+		  fdc_start( fdc, (val & 0x04) ? fdc_ms( FDC_SETTLE) : 0);
 		  break;
 		case 0xC0:	// READ ADDRESS
-		  fdc->data = track_id;
-		  ptr = NULL;
+		  fdc->data = *track_id;
 		  break;
 		case 0xE0:	// READ TRACK - not implemented
-		  printf( "Read track %d - not implemented !\n", track_id);
-		  ptr = NULL;
+		  printf( "Read track %d - not implemented !\n", *track_id);
 		  break;
 		case 0xF0:	// WRITE TRACK - not implemented
-		  printf( "write track %d - not implemented !\n", track_id);
-		  ptr = NULL;
+		  printf( "write track %d - not implemented !\n", *track_id);
 		  break;
 		case 0xD0:	// FORCE INTERRUPT
-		  fdc->sr &= 0xFD;
-		  ptr = NULL;
+		  fdc->sr &= fdc->timed ? 0xFC : 0xFD;
+		  if (fdc->timed && (val & 0x08))
+			fdc_intrq( dev);
+		  if (fdc->flush != LONG_MAX)
+			fdc_flush( fdc);
 		  break;
 	  }
 	  return;
@@ -248,17 +564,74 @@ void fd1795_write( struct Device *dev, uint16_t reg, uint8_t val) {
 	  return;
 	case 0x03 :
 	  fdc->data = val;
-	  if (ptr != NULL && ptr < end)
-	    *ptr++ = val; 
-	  if (ptr == end)
-	    fdc->sr &= 0xFC;
+	  if (fdc->ptr >= 0 && (fdc->sr & 0x02)) {
+		if (fdc->pos == 0 && fdc->fast && fdc_fastwrite( dev, fdc, val))
+		  fdc->pos = fdc->len;
+		else
+		  fdc->buf[fdc->pos++] = val;
+		fdc_byte( dev, fdc);
+	  }
 	  return;
   }
 }
 
+// drive select : a transfer in progress is lost
+static uint8_t fdlatch_read( struct Device *dev, uint16_t reg) {
+  return ((struct Fdc *)dev->registers)->latch;
+}
+
+static void fdlatch_write( struct Device *dev, uint16_t reg, uint8_t val) {
+  struct Fdc *fdc;
+  fdc = dev->registers;
+  fdc->latch = val;
+  fdc->ptr = -1;
+  if (fdc->phase >= FDC_SEARCH) {	// the sector went with the drive
+	fdc->phase = FDC_IDLE;
+	fdc->due = LONG_MAX;
+	fdc->sr &= 0xFC;
+  }
+  fdc->sr = (fdc->sr & 0x3f) | fdc_drive( fdc)->readonly;
+}
+
+// the sectors written are due to be flushed, or timed, the next event,
+// INTRQ being raised while it holds
+void fd1795_run( struct Device *dev) {
+  struct Fdc *fdc;
+  fdc = dev->registers;
+  if (fdc->flush <= cycles)
+	fdc_flush( fdc);
+  if (fdc->due <= cycles)
+	fdc_event( dev, fdc);
+  if (fdc->intrq)
+	switch (dev->interrupt) {
+	  case 'F': firq(); break;
+	  case 'I': irq(); break;
+	  case 'N': nmi();
+	  default: break;
+	}
+}
+
+long fd1795_deadline( struct Device *dev) {
+  struct Fdc *fdc;
+  fdc = dev->registers;
+  if (fdc->intrq)
+	return cycles;
+  return fdc->due < fdc->flush ? fdc->due : fdc->flush;
+}
+
 void fd1795_reg( struct Device *dev) {
   struct Fdc *fdc;
+  int n;
   fdc = dev->registers;
-  printf( "SR:%02X,CR:%02X, track=%d, sector=%d, track_id=%d, data:%02X\n",
-	fdc->sr, fdc->cr, fdc->track, fdc->sector, track_id, fdc->data);
+  n = fdc->latch & (FDC_DRIVES - 1);
+  printf( "SR:%02X,CR:%02X, track=%d, sector=%d, drive %d '%s' track_id=%d, data:%02X\n",
+	fdc->sr, fdc->cr, fdc->track, fdc->sector, n, fdc->drive[n].label,
+	fdc->head[n], fdc->data);
+  if (fdc->due != LONG_MAX)
+	printf( "  phase %d in %ld cycles\n", fdc->phase, (long)(fdc->due - cycles));
 }
+
+const struct DevOps fd1795_ops = {
+	fd1795_init, fd1795_reset, fd1795_read, fd1795_write,
+	fd1795_run, fd1795_deadline, fd1795_reg
+};
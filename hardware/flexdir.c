@@ -0,0 +1,471 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4:
+   flexdir.c -- host directory seen as a FLEX disk
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+
+#include "../emu/config.h"
+#include "../emu/emu6809.h"
+#include "hardware.h"
+
+/*
+   The files of a host directory, with a FLEX name (8 letters, digits, - or
+   _ beginning by a letter, and an extension of 3), are shown on a FLEX
+   disk of FLEXDIR_TRACKS tracks of FLEXDIR_SECTORS sectors, unless given
+   as "dir@<tracks>x<sides>x<sectors>". Nothing is read at mount : the
+   directory is scanned at the first access, each file being given
+   contiguous sectors after the directory, the free chain going on to the
+   end of the disk. A sector is built at its first access, the boot sectors,
+   the SIR and the directory from the scan, the data of a file being read
+   from the host file then. It is then kept in memory, with what is written.
+   With DISK_WRITEBACK, the directory is read back at each flush : a file
+   whose entry or sectors were written is written back from its sector
+   chain (the nulls at the end of its last sector being left out), renamed
+   if its name changed, and removed if its entry is deleted. A host file
+   changed after the scan is not seen.
+*/
+
+#define FLEXDIR_TRACKS 80
+#define FLEXDIR_SECTORS 36
+#define FLEXDIR_DATA 252		// bytes of a file in a sector
+#define FLEXDIR_ENTRY 24		// bytes of a directory entry
+
+// a host file on the disk
+struct FlexFile {
+	char host[13];			// lower or upper case, as in the directory
+	char name[12];			// FLEX name and extension, upper case
+	int32_t first;			// first sector, from track 1
+	int32_t nsec;
+	time_t mtime;
+};
+
+// a directory entry as written back at the last flush
+struct FlexSlot {
+	char host[13];			// "" if not a host file
+	uint8_t ent[FLEXDIR_ENTRY];
+};
+
+struct FlexDir {
+	char *path;
+	int scanned;
+	struct FlexFile *file;
+	int nfiles;
+	int32_t ndir;			// directory sectors
+	int32_t nfree, firstfree;	// free chain, by sector from track 1
+	uint8_t **cache;		// sectors built or written, by number
+	uint8_t *written;		// bitmap of the sectors written since the flush
+	struct FlexSlot *slot;
+	int nslots;
+};
+
+static int flexdir_cmp( const void *a, const void *b) {
+	return strcmp( ((struct FlexFile *)a)->name, ((struct FlexFile *)b)->name);
+}
+
+// FLEX name of a host file, 0 if it has none
+static int flexdir_name( char *host, char *name) {
+	char *dot = strrchr( host, '.');
+	int i, n, e;
+
+	n = dot ? dot - host : strlen( host);
+	e = dot ? strlen( dot + 1) : 0;
+	if (n < 1 || n > 8 || e > 3 || !isalpha( (unsigned char)host[0]))
+	  return 0;
+	for (i = 0; i < n + (dot ? 1 + e : 0); i++)
+	  if (i != n && !isalnum( (unsigned char)host[i]) && host[i] != '-' && host[i] != '_')
+		return 0;
+	memset( name, 0, 12);
+	for (i = 0; i < n; i++)
+	  name[i] = toupper( (unsigned char)host[i]);
+	for (i = 0; i < e; i++)
+	  name[8+i] = toupper( (unsigned char)dot[1+i]);
+	return 1;
+}
+
+// sector number of the track and sector of a link, -1 if none
+static int32_t flexdir_num( struct Disk *disk, uint8_t *link) {
+	if (link[0] > disk->nbtrk || link[1] < 1 || link[1] > disk->nbsec)
+	  return -1;
+	return link[0] * disk->nbsec + link[1] - 1;
+}
+
+static void flexdir_link( struct Disk *disk, uint8_t *link, int32_t n) {
+	link[0] = n < 0 ? 0 : n / disk->nbsec;
+	link[1] = n < 0 ? 0 : n % disk->nbsec + 1;
+}
+
+// sector number of the directory sector k
+static int32_t flexdir_dirsec( struct Disk *disk, int32_t k) {
+	return k < disk->nbsec - 4 ? k + 4 : k - (disk->nbsec - 4) + disk->nbsec;
+}
+
+static void flexdir_date( uint8_t *d, time_t t) {
+	struct tm tm;
+
+	localtime_r( &t, &tm);
+	d[0] = tm.tm_mon + 1;
+	d[1] = tm.tm_mday;
+	d[2] = tm.tm_year % 100;
+}
+
+// directory entry of the file i
+static void flexdir_entry( struct Disk *disk, int i, uint8_t *ent) {
+	struct FlexFile *f = &disk->dir->file[i];
+
+	memset( ent, 0, FLEXDIR_ENTRY);
+	memcpy( ent, f->name, 11);
+	flexdir_link( disk, ent + 13, f->first + disk->nbsec);
+	flexdir_link( disk, ent + 15, f->first + f->nsec - 1 + disk->nbsec);
+	ent[17] = f->nsec >> 8;
+	ent[18] = f->nsec;
+	flexdir_date( ent + 21, f->mtime);
+}
+
+// lay the files out on the disk, from the host directory
+static void flexdir_scan( struct Disk *disk) {
+	struct FlexDir *dir = disk->dir;
+	struct FlexFile *f;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+	int32_t n, total, dirsec = disk->nbsec - 4;
+	DIR *d;
+	int i, max = 0;
+
+	dir->scanned = 1;
+	if ((d = opendir( dir->path)) == NULL) {
+	  printf( "directory %s unreachable\n", dir->path);
+	  return;
+	}
+	while ((de = readdir( d)) != NULL) {
+	  if (strlen( de->d_name) > 12)
+		continue;
+	  if (dir->nfiles == max) {
+		max = max ? 2 * max : 64;
+		if ((dir->file = realloc( dir->file, max * sizeof( struct FlexFile))) == NULL) {
+		  fprintf( stderr, "Not enough memory for directory %s\n", dir->path);
+		  abort();
+		}
+	  }
+	  f = &dir->file[dir->nfiles];
+	  snprintf( path, PATH_MAX, "%s/%s", dir->path, de->d_name);
+	  if (!flexdir_name( de->d_name, f->name) || stat( path, &st) || !S_ISREG( st.st_mode))
+		continue;
+	  strcpy( f->host, de->d_name);
+	  f->nsec = st.st_size ? (st.st_size + FLEXDIR_DATA - 1) / FLEXDIR_DATA : 1;
+	  f->mtime = st.st_mtime;
+	  dir->nfiles++;
+	}
+	closedir( d);
+	qsort( dir->file, dir->nfiles, sizeof( struct FlexFile), flexdir_cmp);
+
+	// the directory, then the files as long as they fit
+	dir->ndir = (dir->nfiles + 9) / 10 > dirsec ? (dir->nfiles + 9) / 10 : dirsec;
+	total = disk->nbtrk * disk->nbsec;
+	n = dir->ndir - dirsec;
+	for (i = 0; i < dir->nfiles; i++) {
+	  f = &dir->file[i];
+	  if (i && strcmp( f->name, f[-1].name) == 0) {
+		printf( "%s/%s: FLEX name already taken\n", dir->path, f->host);
+		memmove( f, f + 1, (--dir->nfiles - i) * sizeof( struct FlexFile));
+		i--;
+		continue;
+	  }
+	  if (n + f->nsec > total) {
+		printf( "%s: disk full, %d files left out\n", dir->path, dir->nfiles - i);
+		dir->nfiles = i;
+		break;
+	  }
+	  f->first = n;
+	  n += f->nsec;
+	}
+	dir->firstfree = n;
+	dir->nfree = total - n;
+
+	// as if written back, for the first flush
+	if (dir->nfiles > dir->nslots) {
+	  dir->nslots = dir->nfiles;
+	  free( dir->slot);
+	  dir->slot = mmalloc( dir->nslots * sizeof( struct FlexSlot));
+	  memset( dir->slot, 0, dir->nslots * sizeof( struct FlexSlot));
+	}
+	for (i = 0; i < dir->nfiles; i++) {
+	  strcpy( dir->slot[i].host, dir->file[i].host);
+	  flexdir_entry( disk, i, dir->slot[i].ent);
+	}
+}
+
+// file owning the sector n from track 1, -1 if none
+static int flexdir_file( struct FlexDir *dir, int32_t n) {
+	int lo = 0, hi = dir->nfiles - 1, mid;
+
+	while (lo <= hi) {
+	  mid = (lo + hi) / 2;
+	  if (n < dir->file[mid].first)
+		hi = mid - 1;
+	  else if (n >= dir->file[mid].first + dir->file[mid].nsec)
+		lo = mid + 1;
+	  else
+		return mid;
+	}
+	return -1;
+}
+
+// sector n as at the scan, the data of the files only if data is set
+static void flexdir_make( struct Disk *disk, int32_t n, uint8_t *buf, int data) {
+	struct FlexDir *dir = disk->dir;
+	struct FlexFile *f;
+	char path[PATH_MAX];
+	int32_t k, l, last = disk->nbtrk * disk->nbsec - 1;
+	int i, fd;
+
+	memset( buf, 0, DISK_SECSIZE);
+	if (n == 2) {			// system information record
+	  memcpy( buf + 0x10, disk->label, strlen( disk->label));
+	  buf[0x1C] = 1;
+	  if (dir->nfree) {
+		flexdir_link( disk, buf + 0x1D, dir->firstfree + disk->nbsec);
+		flexdir_link( disk, buf + 0x1F, last + disk->nbsec);
+	  }
+	  buf[0x21] = dir->nfree >> 8;
+	  buf[0x22] = dir->nfree;
+	  flexdir_date( buf + 0x23, time( NULL));
+	  buf[0x26] = disk->nbtrk;
+	  buf[0x27] = disk->nbsec;
+	  return;
+	}
+	if (n < 4)				// boot
+	  return;
+
+	k = n < disk->nbsec ? n - 4 : n - disk->nbsec + disk->nbsec - 4;
+	if (k < dir->ndir) {	// directory
+	  flexdir_link( disk, buf, k + 1 < dir->ndir ? flexdir_dirsec( disk, k + 1) : -1);
+	  for (i = 0; i < 10 && 10 * k + i < dir->nfiles; i++)
+		flexdir_entry( disk, 10 * k + i, buf + 16 + FLEXDIR_ENTRY * i);
+	  return;
+	}
+
+	l = n - disk->nbsec;
+	if ((i = flexdir_file( dir, l)) < 0) {	// free chain
+	  flexdir_link( disk, buf, l < last ? n + 1 : -1);
+	  return;
+	}
+	f = &dir->file[i];
+	k = l - f->first;
+	flexdir_link( disk, buf, k + 1 < f->nsec ? n + 1 : -1);
+	buf[2] = (k + 1) >> 8;
+	buf[3] = k + 1;
+	if (!data)
+	  return;
+	snprintf( path, PATH_MAX, "%s/%s", dir->path, f->host);
+	if ((fd = open( path, O_RDONLY)) < 0) {
+	  printf( "%s unreachable\n", path);
+	  return;
+	}
+	if (pread( fd, buf + 4, FLEXDIR_DATA, (off_t)k * FLEXDIR_DATA) < 0)
+	  printf( "%s unreadable\n", path);
+	close( fd);
+}
+
+// sector n, built at its first access
+static uint8_t *flexdir_sector( struct Disk *disk, int32_t n) {
+	struct FlexDir *dir = disk->dir;
+
+	if (!dir->scanned)
+	  flexdir_scan( disk);
+	if (dir->cache[n] == NULL) {
+	  dir->cache[n] = mmalloc( DISK_SECSIZE);
+	  flexdir_make( disk, n, dir->cache[n], 1);
+	}
+	return dir->cache[n];
+}
+
+// data of the sector at off
+uint8_t *flexdir_data( struct Disk *disk, int32_t off, int write) {
+	struct FlexDir *dir = disk->dir;
+	int32_t n = off / DISK_SECSIZE;
+
+	if (write && !(dir->written[n >> 3] & (1 << (n & 7)))) {
+	  dir->written[n >> 3] |= 1 << (n & 7);
+	  disk->ndirty++;
+	}
+	return flexdir_sector( disk, n);
+}
+
+// link of the sector n, without reading a host file
+static int32_t flexdir_next( struct Disk *disk, int32_t n) {
+	uint8_t buf[DISK_SECSIZE];
+
+	if (disk->dir->cache[n] != NULL)
+	  return flexdir_num( disk, disk->dir->cache[n]);
+	flexdir_make( disk, n, buf, 0);
+	return flexdir_num( disk, buf);
+}
+
+// sectors of the file of an entry, read into memory before its host file
+// changes, copied to data if not NULL. Returns the length of the file
+static int32_t flexdir_chain( struct Disk *disk, uint8_t *ent, uint8_t *data) {
+	int32_t n, i, count = ent[17] << 8 | ent[18], len = 0;
+
+	n = flexdir_num( disk, ent + 13);
+	for (i = 0; i < count && n >= 0; i++, n = flexdir_next( disk, n)) {
+	  if (data != NULL)
+		memcpy( data + len, flexdir_sector( disk, n) + 4, FLEXDIR_DATA);
+	  else
+		flexdir_sector( disk, n);
+	  len += FLEXDIR_DATA;
+	}
+	return len;
+}
+
+// write back the file of a directory entry, if it changed
+static void flexdir_file_back( struct Disk *disk, struct FlexSlot *s, uint8_t *ent) {
+	struct FlexDir *dir = disk->dir;
+	char host[13], path[PATH_MAX], old[PATH_MAX];
+	int32_t n, i, count = ent[17] << 8 | ent[18], len;
+	uint8_t *data;
+	int changed, fd, k;
+
+	for (i = k = 0; i < 8 && ent[i]; i++)
+	  host[k++] = tolower( ent[i]);
+	if (ent[8])
+	  host[k++] = '.';
+	for (i = 8; i < 11 && ent[i]; i++)
+	  host[k++] = tolower( ent[i]);
+	host[k] = 0;
+	if (k == 0)
+	  return;
+
+	changed = memcmp( s->ent, ent, FLEXDIR_ENTRY) != 0;
+	n = flexdir_num( disk, ent + 13);
+	for (i = 0; i < count && n >= 0 && !changed; i++, n = flexdir_next( disk, n))
+	  changed = (dir->written[n >> 3] & (1 << (n & 7))) != 0;
+	if (!changed)
+	  return;
+	data = mmalloc( (size_t)count * FLEXDIR_DATA + 1);
+	len = flexdir_chain( disk, ent, data);
+	for (k = 0; k < FLEXDIR_DATA && len > 0 && data[len-1] == 0; k++)
+	  len--;
+
+	if (s->host[0] && strcasecmp( s->host, host) != 0) {
+	  snprintf( old, PATH_MAX, "%s/%s", dir->path, s->host);
+	  snprintf( path, PATH_MAX, "%s/%s", dir->path, host);
+	  if (rename( old, path))
+		printf( "%s not renamed %s\n", old, host);
+	}
+	if (strcasecmp( s->host, host) != 0)
+	  strcpy( s->host, host);	// else keep the case of the host
+	snprintf( path, PATH_MAX, "%s/%s", dir->path, s->host);
+	if ((fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0
+		|| write( fd, data, len) != len)
+	  printf( "%s not written back\n", path);
+	if (fd >= 0)
+	  close( fd);
+	free( data);
+}
+
+// write back what changed in the directory and the files
+void flexdir_flush( struct Disk *disk) {
+	struct FlexDir *dir = disk->dir;
+	struct FlexSlot *s;
+	char path[PATH_MAX];
+	int32_t n, guard = (disk->nbtrk + 1) * disk->nbsec;
+	uint8_t *sec, *ent;
+	int e = 0, i;
+
+	if (!(disk->mode & DISK_WRITEBACK) || disk->ndirty == 0) {
+	  disk->ndirty = 0;
+	  return;
+	}
+	for (n = 4; n >= 0 && guard--; n = flexdir_num( disk, sec)) {
+	  sec = flexdir_sector( disk, n);
+	  for (i = 0; i < 10; i++, e++) {
+		ent = sec + 16 + FLEXDIR_ENTRY * i;
+		if (e == dir->nslots) {
+		  dir->nslots *= 2;
+		  if ((dir->slot = realloc( dir->slot, dir->nslots * sizeof( struct FlexSlot))) == NULL) {
+			fprintf( stderr, "Not enough memory for directory %s\n", dir->path);
+			abort();
+		  }
+		  memset( dir->slot + e, 0, (dir->nslots - e) * sizeof( struct FlexSlot));
+		}
+		s = &dir->slot[e];
+		if (ent[0] == 0xFF && s->host[0]) {	// deleted, its sectors freed
+		  flexdir_chain( disk, s->ent, NULL);
+		  snprintf( path, PATH_MAX, "%s/%s", dir->path, s->host);
+		  unlink( path);
+		  s->host[0] = 0;
+		} else if (ent[0] != 0 && ent[0] != 0xFF)
+		  flexdir_file_back( disk, s, ent);
+		memcpy( s->ent, ent, FLEXDIR_ENTRY);
+	  }
+	}
+	memset( dir->written, 0, ((disk->nbtrk + 1) * disk->nbsec) / 8 + 1);
+	disk->ndirty = 0;
+}
+
+// a directory as the FLEX disk in drive disk, returns 0 on error
+int flexdir_mount( struct Disk *disk, char *path, char *geom) {
+	struct FlexDir *dir;
+	int nbtrk = FLEXDIR_TRACKS, sides = 1, nbsec = FLEXDIR_SECTORS, i;
+	int32_t total;
+	char *base;
+
+	if (geom != NULL && (sscanf( geom, "%dx%dx%d", &nbtrk, &sides, &nbsec) != 3
+		|| nbtrk < 2 || nbtrk > 256 || sides < 1 || sides > 2
+		|| nbsec * sides < 6 || nbsec * sides > 255)) {
+	  printf( "geometry <tracks>x<sides>x<sectors>, not '%s'\n", geom);
+	  return 0;
+	}
+	disk->nbtrk = nbtrk - 1;
+	disk->nbsec = nbsec * sides;	// FLEX numbering, on both sides
+	total = nbtrk * disk->nbsec;
+	disk->size = (size_t)total * DISK_SECSIZE;
+	disk->readonly = access( path, W_OK) ? 0x40 : 0;
+
+	dir = mmalloc( sizeof( struct FlexDir));
+	memset( dir, 0, sizeof( struct FlexDir));
+	dir->path = strdup( path);
+	dir->cache = mmalloc( total * sizeof( uint8_t *));
+	memset( dir->cache, 0, total * sizeof( uint8_t *));
+	dir->written = mmalloc( total / 8 + 1);
+	memset( dir->written, 0, total / 8 + 1);
+	dir->nslots = 64;
+	dir->slot = mmalloc( dir->nslots * sizeof( struct FlexSlot));
+	memset( dir->slot, 0, dir->nslots * sizeof( struct FlexSlot));
+	disk->dir = dir;
+
+	// the label is the name of the directory
+	base = strrchr( path, '/');
+	base = base && base[1] ? base + 1 : path;
+	for (i = 0; i < 8 && isalnum( (unsigned char)base[i]); i++)
+	  disk->label[i] = toupper( (unsigned char)base[i]);
+	disk->label[i] = 0;
+	return 1;
+}
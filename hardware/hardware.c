@@ -29,6 +29,7 @@
 #include <pwd.h>
 #include <error.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <stdlib.h>
 #include "config.h"
@@ -46,11 +47,27 @@
  * other lines contain name of device followed by its base address and
  * interrupt line. For ACIA, also speed in bps (default to 9600)
  * name recognised: mc6840, mc6850, mc6820, mc6821, m6520, m6521, m6522, m6532
+ * fd1795, ide, fake, bank and mmu, each driver reading the rest of its line
+ * rom may be followed by an image file, mapped read only and shared
  * Ex: rom F800 # 2K of rom from F800 to FFFF
+ *     rom F000 sbug.bin # rom from F000, sbug.bin ending at FFFF
  *     mem 0000 8000 # 32 K ram @0000
  *     mc6840 E020 FIRQ # TIMER @ 0x020, connected to FIRQ
  *     mc6850 E000 IRQ 19200 # ACIA @ 0xe000, connected to IRQ, 19200 bps
+ *     mc6850 E010 IRQ 9600 tcp 6809 # ACIA on localhost:6809 (xterm, stdio,
+ *                                   # file <in> <out>, unix <path>, tcp <port>)
  *     m6522 E040 # VIA @ 0xe040, interrupt line not connected
+ *     bank E050 8000 C000 # bank latch @ 0xe050 switching 8000-BFFF
+ *     mmu FFF0 4 1 writeonly # DAT @ 0xfff0, 16 pages of 4K, 1 task
+ *     fd1795 E018 IRQ latch E014 flex.dsk work.dsk # FDC, drive select
+ *                                   # latch @ 0xe014, drives 0 and 1
+ *                                   # (FLEX, .jv1, .jv3, .dmk, .imd,
+ *                                   # or name@<tracks>x<sides>x<sectors>,
+ *                                   # or a directory of host files,
+ *                                   # .dsz made by sim6809 -z, read only)
+ *     ide E060 IRQ os9.img@64M # IDE task file @ 0xe060, 64 MB image
+ * plugin loads a device type from a shared object (see sim6809_plugin.h)
+ *     plugin ./mydev.so # defines the device keyword "mydev"
 */
 
 // Default values
@@ -64,6 +81,88 @@ uint16_t rom = 0xF000;
 
 int loading = 0;
 struct Device *devices = NULL;
+struct Device **iopage[256];
+long dev_deadline = 0;
+
+// Device types known, by their keyword in the config file
+static struct DevType {
+	char keyword[16];
+	const struct DevOps *ops;
+	struct DevType *next;
+} builtin[] = {
+	{ "MC6820", &mc6820_ops },
+	{ "MC6821", &mc6820_ops },
+	{ "R6520",  &mc6820_ops },
+	{ "R6521",  &mc6820_ops },
+	{ "MC6840", &mc6840_ops },
+	{ "MC6850", &mc6850_ops },
+	{ "R6522",  &r6522_ops },
+	{ "R6532",  &r6532_ops },
+	{ "FD1795", &fd1795_ops },
+	{ "IDE",    &ide_ops },
+	{ "FAKE",   &fake_ops },
+	{ "BANK",   &bank_ops },
+	{ "MMU",    &mmu_ops },
+};
+static struct DevType *devtypes = NULL;
+
+// add a device type, found before the builtin ones
+void dev_register( char *keyword, const struct DevOps *ops) {
+  struct DevType *type;
+  char *p;
+
+  type = mmalloc( sizeof( struct DevType));
+  strncpy( type->keyword, keyword, 15);
+  type->keyword[15] = 0;
+  for (p = type->keyword; *p; p++)
+	*p = toupper( *p);
+  type->ops = ops;
+  type->next = devtypes;
+  devtypes = type;
+}
+
+static const struct DevOps *find_type( char *keyword) {
+  struct DevType *type;
+  int i;
+
+  for (type = devtypes; type != NULL; type = type->next)
+	if (strcmp( type->keyword, keyword) == 0)
+	  return type->ops;
+  for (i = 0; i < sizeof( builtin) / sizeof( builtin[0]); i++)
+	if (strcmp( builtin[i].keyword, keyword) == 0)
+	  return builtin[i].ops;
+  return NULL;
+}
+
+// link a new device and map its addresses, the last one wins on overlap
+void dev_add( struct Device *dev) {
+  uint32_t adr;
+
+  dev->next = devices;
+  devices = dev;
+  for (adr = dev->addr; adr < dev->end; adr++) {
+	if (iopage[adr >> 8] == NULL) {
+	  iopage[adr >> 8] = mmalloc( 256 * sizeof( struct Device *));
+	  memset( iopage[adr >> 8], 0, 256 * sizeof( struct Device *));
+	}
+	iopage[adr >> 8][adr & 0xff] = dev;
+  }
+  dev_deadline = 0;
+}
+
+// interrupt line on a config line : IRQ, FIRQ or NMI, 'X' if not connected
+char read_intline( char **args) {
+  char c;
+
+  if (!more_params( args))
+	return 'X';
+  c = toupper( **args);
+  if (c != 'I' && c != 'F' && c != 'N')
+	return 'X';
+  while (isalpha( **args))
+	(*args)++;
+  return c;
+}
 
 // show devices with their status
 void showdev() {
@@ -81,15 +180,10 @@ void showdev() {
 	}
 	printf ("%s @ 0x%04X (interrupt: %s) ", dev->devname, dev->addr, itxt);
 	
-    switch (dev->type) {
-	  case MC6850: mc6850_reg( dev); break;
-	  case MC6840: mc6840_reg( dev); break;
-	  case MC6820: mc6820_reg( dev); break;
-	  case R6522:  r6522_reg( dev); break;
-	  case R6532:  r6532_reg( dev); break;
-	  case FD1795: fd1795_reg( dev); break;
-	  default:     printf( "length=%04X\n", dev->end-dev->addr); break;
-	}
+	if (dev->ops->show != NULL)
+	  dev->ops->show( dev);
+	else
+	  printf( "length=%04X\n", dev->end-dev->addr);
 	dev = dev->next;
   }
 }
@@ -97,14 +191,13 @@ void showdev() {
 void get_config( uid_t uid) {
   char *filename;
   int n;
-  uint16_t param1, param2;
   FILE *fconf = NULL;
-  char line[80];
+  char line[256];
 
   struct passwd *pw = getpwuid(uid);
-  char int_line, *strptr, *strptr2, *keyword;
-  int32_t speed;
-  char **tail;
+  char *strptr, *keyword, name[16];
+  const struct DevOps *ops;
+  uint16_t adr;
 
   if (pw)
   {
@@ -122,62 +215,36 @@ void get_config( uid_t uid) {
   }
 
   if (fconf != NULL) { // Overwrite default values
-    while( fgets( line, 80, fconf) != NULL) {
+    while( fgets( line, 256, fconf) != NULL) {
 	  if (*line == '#')
 	    continue;
 	  strptr = line;
-	  strptr = line;
+	  if (!more_params( &strptr))
+		continue;
 	  keyword = readstr( &strptr);
-	  strptr2 = keyword;
-	  while (*strptr2) {
-	    *strptr2 = toupper( *strptr2);
-		strptr2++;
+	  for (n = 0; keyword[n] && n < 15; n++)	// readstr() buffer is reused
+	    name[n] = toupper( keyword[n]);
+	  name[n] = 0;
+	  if (strcmp( name, "PLUGIN") == 0) {
+		plugin_load( readstr( &strptr));
+		continue;
 	  }
 	  if (more_params( &strptr))
-	    param1 = readhex( &strptr);
+	    adr = readhex( &strptr);
 	  else
-	    param1 = 0;
-	  if (more_params( &strptr)) {
-	  	int_line = toupper(*strptr);
-		strptr2 = strptr;
-	    param2 = readhex( &strptr);
-	  } else {
-	    int_line = 'X';
-	    param2 = 0;
+	    adr = 0;
+	  if (strcmp( name, "ROM") == 0) {
+	    rom = adr;
+		if (more_params( &strptr))
+		  rom_map( readstr( &strptr));
 	  }
-	  if (strcmp( keyword, "ROM") == 0)
-	    rom = param1;
-	  else if (strcmp( keyword, "MEM") == 0) {
-		mem_low = param1;
-		mem_high = param2;
-	  } else if (strcmp( keyword, "MC6840") == 0)
-		mc6840_init( keyword, param1, int_line);
-	  else if (strcmp( keyword, "MC6850") == 0) {
-		while (isalpha( *strptr2))
-		  strptr2++;
-		if (more_params( &strptr2))
-		  speed = strtol( strptr2, tail, 10);
-		else
-		  speed = 9600;
-		mc6850_init( keyword, param1, int_line, speed);
-	  } else if (strcmp( keyword, "MC6820") == 0)
-		mc6820_init( keyword, param1, int_line);
-	  else if (strcmp( keyword, "MC6821") == 0)
-		mc6820_init( keyword, param1, int_line);
-	  else if (strcmp( keyword, "R6520") == 0)
-		mc6820_init( keyword, param1, int_line);
-	  else if (strcmp( keyword, "R6521") == 0)
-		mc6820_init( keyword, param1, int_line);
-	  else if (strcmp( keyword, "R6522") == 0)
-		r6522_init( keyword, param1, int_line);
-	  else if (strcmp( keyword, "R6532") == 0)
-		r6532_init( keyword, param1, int_line);
-	  else if (strcmp( keyword, "FD1795") == 0)
-		fd1795_init( keyword, param1, int_line, readstr( &strptr2));
-	  else if (strcmp( keyword, "FAKE") == 0)
-		fake_init( keyword, param1, param2);
+	  else if (strcmp( name, "MEM") == 0) {
+		mem_low = adr;
+		mem_high = readhex( &strptr);
+	  } else if ((ops = find_type( name)) != NULL)
+		ops->init( name, adr, strptr);
 	  else
-	    printf( "Unrecognised device '%s' in '%s'\n", keyword, filename);
+	    printf( "Unrecognised device '%s' in '%s'\n", name, filename);
 
 	  if (rom < 0)
 		rom = 0xFFFF; // No rom ???
@@ -188,38 +255,43 @@ void get_config( uid_t uid) {
 	}
   } else {
     printf( "No config file, using default values...\n");
-	mc6850_init( "MC6821", 0xE000, 'I', 9600);
+	mc6850_ops.init( "MC6850", 0xE000, "IRQ 9600");
   }
 }
 
-// clock vs devices
+// clock vs devices : only when a device asked for it
 void device_run() {
   struct Device *dev;
-  dev = devices;
-  while (dev != NULL) {
-    switch (dev->type) {
-	  case MC6850: mc6850_run( dev); break;
-	  case MC6840: mc6840_run( dev); break;
-	  case MC6820: mc6820_run( dev); break;
-	  case R6522: r6522_run( dev); break;
-	  case R6532: r6532_run( dev); break;
-	  default: break;
+  long next, t;
+
+  if (cycles < dev_deadline)
+	return;
+  next = LONG_MAX;
+  for (dev = devices; dev != NULL; dev = dev->next) {
+	if (dev->ops->run == NULL)
+	  continue;
+	if (dev->ops->next_deadline == NULL) {
+	  dev->ops->run( dev);
+	  next = cycles;	// every time around the loop
+	  continue;
 	}
-	dev = dev->next;
+	if (dev->ops->next_deadline( dev) <= cycles)
+	  dev->ops->run( dev);
+	if ((t = dev->ops->next_deadline( dev)) < next)
+	  next = t;
   }
+  dev_deadline = next;
 }
 
-// Search a device from its address
-struct Device *look_dev( uint16_t adr)
-{
+// reset line : the devices back to their state at power up, before the
+// cpu reads its reset vector through a bank or mmu
+void device_reset() {
   struct Device *dev;
-  dev = devices;
-  while (dev != NULL) {
-  	if (adr >= dev->addr && adr < dev->end)
-	  break;
-	dev = dev->next;
-  }
-  return dev;
+
+  for (dev = devices; dev != NULL; dev = dev->next)
+	if (dev->ops->reset != NULL)
+	  dev->ops->reset( dev);
+  dev_deadline = 0;
 }
 
 // reading a device
@@ -230,15 +302,7 @@ uint8_t read_device(uint16_t adr)
     err6809 = ERR_NO_DEVICE;
 	return 0;
   }
-  switch (dev->type) {
-    case MC6850: return mc6850_read( dev, adr);
-    case MC6840: return mc6840_read( dev, adr);
-    case MC6820: return mc6820_read( dev, adr);
-    case R6522:  return r6522_read( dev, adr);
-    case R6532:  return r6532_read( dev, adr);
-    case FD1795: return fd1795_read( dev, adr);
-    case FAKE:   return fake_read( dev, adr);
-  }
+  return dev_read( dev, adr);
 }
 
 // writing a device
@@ -249,13 +313,5 @@ extern void write_device(uint16_t adr, uint8_t val)
     err6809 = ERR_NO_DEVICE;
 	return;
   }
-  switch (dev->type) {
-    case MC6850: mc6850_write( dev, adr, val);return; 
-    case MC6840: mc6840_write( dev, adr, val);return; 
-    case MC6820: mc6820_write( dev, adr, val);return; 
-    case R6522:  r6522_write( dev, adr, val);return; 
-    case R6532:  r6532_write( dev, adr, val);return; 
-    case FD1795: fd1795_write( dev, adr, val);return; 
-    case FAKE:   fake_write( dev, adr, val);return; 
-  }
+  dev_write( dev, adr, val);
 }
@@ -17,80 +17,220 @@
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 
+#include <stdatomic.h>
+
 extern uint16_t mem_low ;	// base address of physical memory emulated
 extern uint16_t mem_high ;	// upper limit of physical memory emulated
 extern uint16_t rom ;		// base address of rom (allways on top of memory)
 
 extern int loading ;
 
+struct Device;
+
+/* Operations of a device type, registered under a keyword of .sim6809.ini.
+   Only init and read/write are mandatory. */
+struct DevOps {
+	// create a device, args holds the config line after the address
+	void (*init)( char *devname, uint16_t adr, char *args);
+	// back to the power up state, at init and on the "x" console command
+	void (*reset)( struct Device *dev);
+	uint8_t (*read)( struct Device *dev, uint16_t adr);
+	void (*write)( struct Device *dev, uint16_t adr, uint8_t val);
+	// called from the execution loop, not before next_deadline() if any
+	void (*run)( struct Device *dev);
+	long (*next_deadline)( struct Device *dev);
+	void (*show)( struct Device *dev);
+};
+
+// the first fields are struct sim6809_device of the plugins, keep them
 extern struct Device {
-	char devname[16];
-	int type;
+	void *registers;
 	uint16_t addr;
 	uint16_t end;
 	char interrupt;
-	void *registers;
+	char devname[16];
+	const struct DevOps *ops;
 	struct Device *next;
 	} *devices;
 
-extern struct Device *look_dev( uint16_t adr);
+// device at each address, one table of 256 entries per page holding a device
+extern struct Device **iopage[256];
+extern long dev_deadline;	// cycle of the next device_run() needed
+
+static inline struct Device *look_dev( uint16_t adr) {
+  struct Device **page = iopage[adr >> 8];
+  return page != NULL ? page[adr & 0xff] : NULL;
+}
+
+static inline uint8_t dev_read( struct Device *dev, uint16_t adr) {
+  dev_deadline = 0;	// the access may change the next deadline
+  return dev->ops->read( dev, adr);
+}
+
+static inline void dev_write( struct Device *dev, uint16_t adr, uint8_t val) {
+  dev_deadline = 0;
+  dev->ops->write( dev, adr, val);
+}
+
+extern void dev_register( char *keyword, const struct DevOps *ops);
+extern void dev_add( struct Device *dev);
+extern char read_intline( char **args);
 extern void showdev();
 extern void device_run();
+extern void device_reset();
+extern int plugin_load( char *filename);
 extern uint8_t read_device(uint16_t adr);
 extern void write_device(uint16_t adr, uint8_t val);
 
-extern void mc6820_init( char* devname, uint16_t adr, char int_line);
-extern void mc6820_run( struct Device *dev);
-extern uint8_t mc6820_read( struct Device *dev, uint16_t adr);
-extern void mc6820_write( struct Device *dev, uint16_t adr, uint8_t val);
-extern void mc6820_reg( struct Device *dev);
-
-extern void mc6840_init( char* devname, uint16_t adr, char int_line);
-extern void mc6840_run( struct Device *dev);
-extern uint8_t mc6840_read( struct Device *dev, uint16_t adr);
-extern void mc6840_write( struct Device *dev, uint16_t adr, uint8_t val);
-extern void mc6840_reg( struct Device *dev);
-
-extern void mc6850_init( char* devname, uint16_t adr, char int_line, int32_t speed);
-extern void mc6850_run( struct Device *dev);
-extern uint8_t mc6850_read( struct Device *dev, uint16_t adr);
-extern void mc6850_write( struct Device *dev, uint16_t adr, uint8_t val);
-extern void mc6850_reg( struct Device *dev);
-
-extern void r6522_init( char* devname, uint16_t adr, char int_line);
-extern void r6522_run( struct Device *dev);
-extern uint8_t r6522_read( struct Device *dev, uint16_t adr);
-extern void r6522_write( struct Device *dev, uint16_t adr, uint8_t val);
-extern void r6522_reg( struct Device *dev);
-
-extern void r6532_init( char* devname, uint16_t adr, char int_line);
-extern void r6532_run( struct Device *dev);
-extern uint8_t r6532_read( struct Device *dev, uint16_t adr);
-extern void r6532_write( struct Device *dev, uint16_t adr, uint8_t val);
-extern void r6532_reg( struct Device *dev);
-
-extern void fd1795_init( char* devname, uint16_t adr, char int_line, char *dskname);
-extern void fd1795_run( struct Device *dev);
-extern uint8_t fd1795_read( struct Device *dev, uint16_t adr);
-extern void fd1795_write( struct Device *dev, uint16_t adr, uint8_t val);
-extern void fd1795_reg( struct Device *dev);
-
-extern void fake_init( char* devname, uint16_t adr, uint16_t end);
-extern uint8_t fake_read( struct Device *dev, uint16_t adr);
-extern void fake_write( struct Device *dev, uint16_t adr, uint8_t val);
+// Host port of a device : one thread of hostio.c owns the host file
+// descriptors of the serial ports, the cpu loop exchanging data with it
+// through lock free rings. It also runs the jobs posted by the cpu loop.
+#define RING_SIZE 4096	// power of 2
+
+struct HostRing {
+	_Atomic uint32_t head;	// moved by the producer only
+	_Atomic uint32_t tail;	// moved by the consumer only
+	uint8_t data[RING_SIZE];
+};
+
+struct HostPort {
+	_Atomic int fd;			// -1 while waiting for a client to connect
+	int outfd;				// output if not written to fd, else -1
+	int listenfd;			// socket accepting clients, -1 if none
+	int regular;			// input is a regular file, read without epoll
+	int outregular;			// output is a regular file, written without epoll
+	struct HostRing in;		// filled by the I/O thread
+	struct HostRing out;	// filled by the cpu loop
+	_Atomic int stalled;	// input ring was full, the thread waits for room
+	_Atomic int eof;
+	_Atomic int queued;		// output queued since the thread was woken
+	int disabled;			// private to the thread : input not read
+	int blocked;			// private to the thread : waits to write
+	int outdead;			// private to the thread : output dropped
+	struct HostPort *next;
+};
+
+// work done by the I/O thread for a device, as waiting for a disk
+struct HostJob {
+	void (*run)( void *arg);
+	void *arg;
+	_Atomic int posted;		// queued, and not started yet
+	struct HostJob *next;	// private to hostio.c
+};
+
+extern int hostio_watch( struct HostPort *port, int fd, int outfd);
+extern int hostio_listen( struct HostPort *port, int listenfd);
+extern int hostio_write( struct HostPort *port, const uint8_t *buf, int len);
+extern void hostio_resume( struct HostPort *port);
+extern void hostio_console( int hold);
+extern void hostio_idle( struct HostPort *port, int ms);
+extern void hostio_sync( int ms);
+extern void hostio_post( struct HostJob *job);
+
+// next character received, -1 if none : no system call
+static inline int hostio_getc( struct HostPort *port) {
+  uint32_t tail;
+  int c;
+
+  tail = atomic_load_explicit( &port->in.tail, memory_order_relaxed);
+  if (tail == atomic_load_explicit( &port->in.head, memory_order_acquire))
+	return -1;
+  c = port->in.data[tail & (RING_SIZE - 1)];
+  atomic_store( &port->in.tail, tail + 1);
+  if (atomic_load( &port->stalled))
+	hostio_resume( port);
+  return c;
+}
+
+// Disk image of a floppy drive, disk.c
+#define DISK_SECSIZE 256
+#define DISK_WRITEBACK 1	// image mapped shared and written back
+#define DISK_FSYNC 2		// wait for the disk after each flush
+#define DISK_DISCARD 4		// overlay not saved
+#define DISK_COMMIT 8		// overlay written into its base at exit
+
+// where a sector is in the image
+struct DiskSec {
+	int32_t off;			// -1 if there is no such sector
+	uint16_t len;
+};
+
+struct Disk {
+	char label[16];
+	const char *format;		// FLEX, DSK, JV1, JV3, DMK or IMD
+	uint8_t *dsk;			// image mapped in memory, NULL if no disk
+	size_t size;
+	int copy;				// dsk is a copy of the image, not a mapping
+	struct DiskSec *sec;	// index by track, side and sector
+	uint8_t sides;
+	uint8_t firstsec;		// lowest and highest sector numbers
+	uint8_t lastsec;
+	uint8_t readonly;		// 0x40 write protected, 0x80 not ready
+	uint8_t nbtrk;			// last track
+	uint8_t nbsec;			// most sectors on a track side
+	int mode;
+	int fd;					// image or overlay written back, else -1
+	uint8_t *dirty;			// bitmap of the sectors written since the flush
+	int ndirty;
+	struct HostJob sync;	// fdatasync of fd by the I/O thread
+	// overlay on a read only base image
+	char *base;				// file name of the base
+	uint8_t **delta;		// sectors written, NULL if read from the base
+	uint32_t *index;		// slot + 1 of each sector in the overlay, 0 if none
+	uint32_t nslots;
+	uint32_t nsaved;		// nslots in the overlay file
+	struct FlexDir *dir;	// host directory seen as the disk, flexdir.c
+	struct Dsz *dsz;		// compressed image, dsz.c
+	struct Disk *next;
+};
+
+extern int disk_mount( struct Disk *disk, char *name, int mode);
+extern int32_t disk_sector( struct Disk *disk, int track, int side, int sector, int *len);
+extern uint8_t *disk_data( struct Disk *disk, int32_t off, int len, int write);
+extern void disk_flush( struct Disk *disk, int sync);
+// sectors found in an image, before its index is built
+struct DiskEnt {
+	uint8_t track, side, sector;
+	uint16_t len;
+	int32_t off;
+};
+
+struct DiskList {
+	struct DiskEnt *ent;
+	int n, max;
+};
+
+extern void disk_add( struct DiskList *l, int track, int side, int sector,
+		int32_t off, int len);
+extern int flexdir_mount( struct Disk *disk, char *path, char *geom);
+extern uint8_t *flexdir_data( struct Disk *disk, int32_t off, int write);
+extern void flexdir_flush( struct Disk *disk);
+extern int dsz_mount( struct Disk *disk, struct DiskList *l, char *name);
+extern uint8_t *dsz_data( struct Disk *disk, int32_t off, int write);
+extern void dsz_unmount( struct Disk *disk);
+extern int dsz_create( char *image, char *out);
 
 // Interface adapters kown, other can be added
 // Motorola :
-#define MC6820 0	// PIA <=> MC6821, R6520, R6521
-#define MC6840 1	// TIMER
-#define MC6850 2	// ACIA
+extern const struct DevOps mc6820_ops;	// PIA <=> MC6821, R6520, R6521
+extern const struct DevOps mc6840_ops;	// TIMER
+extern const struct DevOps mc6850_ops;	// ACIA
+extern void mc6840_gate( struct Device *dev, int n, int level);	// gate of timer n+1
 
 // Rockwell :
-#define R6522 4		// VIA (Versatile Interface adapter : I/O + timer)
-#define R6532 5		// RIOT (RAM, I/O, TIMER)
+extern const struct DevOps r6522_ops;	// VIA (Versatile Interface adapter : I/O + timer)
+extern void r6522_pb6( struct Device *dev, int level);	// pulses counted by T2
+extern const struct DevOps r6532_ops;	// RIOT (RAM, I/O, TIMER)
 
 // Western Digital
-#define FD1795 8	// Floppy disk controler
+extern const struct DevOps fd1795_ops;	// Floppy disk controler
+
+// Hard disks
+extern const struct DevOps ide_ops;		// IDE / CompactFlash task file
 
 // Dummy device - emulates memory
-#define FAKE 0x10
+extern const struct DevOps fake_ops;
+
+// Memory management
+extern const struct DevOps bank_ops;	// Bank switching latch
+extern const struct DevOps mmu_ops;		// Dynamic address translation
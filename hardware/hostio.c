@@ -0,0 +1,453 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4:
+   hostio.c -- one I/O thread serving the host ports of the devices
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <stdlib.h>
+#include "../emu/config.h"
+#include "../emu/emu6809.h"
+#include "hardware.h"
+
+/*
+   One thread owns the host file descriptors of every device port : it
+   waits on them with epoll, copies what comes into the input ring of the
+   port and writes what the cpu loop queued in its output ring. A ring has
+   a single producer and a single consumer, so the cpu side only compares
+   two indexes, without any system call. The cpu loop wakes the thread
+   through an eventfd when it queues output into an empty ring, or takes a
+   character from a full input ring, the fd of which was left aside.
+   An idle cpu loop may sleep on another eventfd, written by the thread
+   only when it is waited for and something was received.
+   Regular files can't be watched by epoll : they are read and written on
+   each wake up. A listening socket serves one client at a time, the next
+   connection being accepted once the client is gone.
+   Stdin is left to the console while it waits for a command.
+   The thread also runs the jobs posted by the devices, for the system
+   calls that would stall the cpu loop, as fdatasync() of a disk image. A
+   job posted again while it runs is run once more afterwards.
+*/
+
+#define OUTTAG 1	// epoll data of the output fd of a port, not aligned
+
+static int epfd = -1;
+static int wakefd = -1;		// wakes the I/O thread
+static int cpufd = -1;		// wakes the idle cpu loop
+static struct HostPort *ports = NULL;
+static struct HostJob *jobs = NULL;	// posted, in any order
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic int stdin_held = 1;	// the console reads its commands
+static _Atomic int cpu_idle = 0;	// the cpu loop sleeps on cpufd
+
+static void hostio_events( void *data, int fd, int op, uint32_t events) {
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.ptr = data;
+  epoll_ctl( epfd, op, fd, &ev);
+}
+
+// events to wait for on the fds of a port, following its state
+static void hostio_update( struct HostPort *port) {
+  uint32_t out = port->blocked ? EPOLLOUT : 0;
+  int fd;
+
+  fd = atomic_load( &port->fd);
+  if (fd >= 0 && !port->regular)
+	hostio_events( port, fd, EPOLL_CTL_MOD,
+		(port->disabled ? 0 : EPOLLIN) | (port->outfd < 0 ? out : 0));
+  if (port->outfd >= 0 && !port->outregular && !port->outdead)
+	hostio_events( (char *)port + OUTTAG, port->outfd, EPOLL_CTL_MOD, out);
+}
+
+// something was received, wake the cpu loop if it waits for it
+static void hostio_notify( void) {
+  uint64_t one = 1;
+
+  if (atomic_exchange( &cpu_idle, 0))
+	write( cpufd, &one, sizeof( one));
+}
+
+// write the output queued by the cpu loop, as long as the fd takes it
+static void hostio_drain( struct HostPort *port) {
+  uint32_t head, tail, pos, len;
+  int n, fd, blocked;
+
+  fd = port->outfd >= 0 ? port->outfd : atomic_load( &port->fd);
+  if (fd < 0)
+	return;		// no client yet, the output waits for one
+  blocked = port->blocked;
+  for (;;) {
+	tail = atomic_load_explicit( &port->out.tail, memory_order_relaxed);
+	head = atomic_load_explicit( &port->out.head, memory_order_acquire);
+	if (head == tail) {
+	  port->blocked = 0;
+	  break;
+	}
+	pos = tail & (RING_SIZE - 1);
+	len = RING_SIZE - pos < head - tail ? RING_SIZE - pos : head - tail;
+	n = port->outdead ? len : write( fd, port->out.data + pos, len);
+	if (n > 0) {
+	  atomic_store_explicit( &port->out.tail, tail + n, memory_order_release);
+	  continue;
+	}
+	if (n < 0 && errno == EINTR)
+	  continue;
+	if (n < 0 && errno == EAGAIN) {
+	  port->blocked = 1;
+	  break;
+	}
+	if (port->outfd >= 0) {		// output closed, drop what comes
+	  if (!port->outregular)
+		hostio_events( NULL, port->outfd, EPOLL_CTL_DEL, 0);
+	  port->outdead = 1;
+	  continue;
+	}
+	port->blocked = 0;	// client or terminal gone, seen by the input side
+	break;
+  }
+  if (port->blocked != blocked)
+	hostio_update( port);
+}
+
+// a client connects to a listening port
+static void hostio_accept( struct HostPort *port) {
+  int fd;
+
+  if ((fd = accept4( port->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+	return;
+  hostio_events( port, port->listenfd, EPOLL_CTL_DEL, 0);
+  port->disabled = 0;
+  port->blocked = 0;
+  atomic_store( &port->fd, fd);
+  hostio_events( port, fd, EPOLL_CTL_ADD, EPOLLIN);
+  hostio_drain( port);	// output queued while nobody was there
+}
+
+// read what is available into the ring, returns 1 if more can be read now
+static int hostio_fill( struct HostPort *port) {
+  uint32_t head, tail, space, pos, len;
+  int n, fd;
+
+  fd = atomic_load( &port->fd);
+  if (fd == 0 && atomic_load( &stdin_held)) {
+	port->disabled = 1;
+	hostio_update( port);
+	return 0;
+  }
+  head = atomic_load_explicit( &port->in.head, memory_order_relaxed);
+  tail = atomic_load( &port->in.tail);
+  space = RING_SIZE - (head - tail);
+  if (space == 0) {
+	port->disabled = 1;
+	hostio_update( port);
+	atomic_store( &port->stalled, 1);
+	// the consumer may have emptied some place before seeing the flag
+	if (atomic_load( &port->in.tail) != tail && atomic_exchange( &port->stalled, 0)) {
+	  port->disabled = 0;
+	  hostio_update( port);
+	  return 1;
+	}
+	return 0;
+  }
+  pos = head & (RING_SIZE - 1);
+  len = RING_SIZE - pos < space ? RING_SIZE - pos : space;
+  n = read( fd, port->in.data + pos, len);
+  if (n > 0) {
+	atomic_store( &port->in.head, head + n);
+	hostio_notify();
+	return 1;
+  }
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+	return 0;
+  if (port->listenfd >= 0) {	// client gone, wait for the next one
+	hostio_events( NULL, fd, EPOLL_CTL_DEL, 0);
+	atomic_store( &port->fd, -1);
+	close( fd);		// only this thread writes to it
+	hostio_events( port, port->listenfd, EPOLL_CTL_ADD, EPOLLIN);
+	return 0;
+  }
+  if (!port->regular)
+	hostio_events( NULL, fd, EPOLL_CTL_DEL, 0);	// end of input
+  atomic_store( &port->eof, 1);
+  hostio_notify();
+  return 0;
+}
+
+// run the jobs posted, out of the lock as they take time
+static void hostio_jobs( void) {
+  struct HostJob *job;
+
+  for (;;) {
+	pthread_mutex_lock( &lock);
+	if ((job = jobs) != NULL) {
+	  jobs = job->next;
+	  atomic_store( &job->posted, 0);	// may be posted again from now
+	}
+	pthread_mutex_unlock( &lock);
+	if (job == NULL)
+	  return;
+	job->run( job->arg);
+  }
+}
+
+// woken by the cpu loop : room in stalled rings, output queued or jobs
+// posted, regular files are read here
+static void hostio_service( void) {
+  struct HostPort *port;
+  uint64_t n;
+
+  read( wakefd, &n, sizeof( n));
+  hostio_jobs();
+  pthread_mutex_lock( &lock);
+  for (port = ports; port != NULL; port = port->next) {
+	if (port->disabled && !atomic_load( &port->stalled)
+		&& !(port->fd == 0 && atomic_load( &stdin_held))) {
+	  port->disabled = 0;
+	  hostio_update( port);
+	}
+	if (port->regular)
+	  while (!port->disabled && !atomic_load( &port->eof) && hostio_fill( port))
+		;
+	if (atomic_exchange( &port->queued, 0) && !port->blocked)
+	  hostio_drain( port);
+  }
+  pthread_mutex_unlock( &lock);
+}
+
+static void *hostio_loop( void *arg) {
+  struct epoll_event ev[16];
+  struct HostPort *port;
+  int i, n;
+
+  for (;;) {
+	n = epoll_wait( epfd, ev, 16, -1);
+	for (i = 0; i < n; i++) {
+	  port = ev[i].data.ptr;
+	  if (port == NULL)
+		hostio_service();
+	  else if ((uintptr_t)port & OUTTAG)
+		hostio_drain( (struct HostPort *)((char *)port - OUTTAG));
+	  else if (atomic_load( &port->fd) < 0)
+		hostio_accept( port);
+	  else {
+		if (ev[i].events & EPOLLOUT)
+		  hostio_drain( port);
+		if (ev[i].events & ~EPOLLOUT)
+		  hostio_fill( port);
+	  }
+	}
+  }
+  return NULL;
+}
+
+static void hostio_wake( void) {
+  uint64_t one = 1;
+
+  write( wakefd, &one, sizeof( one));
+}
+
+static int hostio_start( void) {
+  struct epoll_event ev;
+  sigset_t all, old;
+  pthread_t thread;
+  int err;
+
+  if ((epfd = epoll_create1( EPOLL_CLOEXEC)) < 0
+	  || (wakefd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+	  || (cpufd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+	printf( "Can't create the host I/O loop (errno. %d)\n", errno);
+	return 0;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl( epfd, EPOLL_CTL_ADD, wakefd, &ev);
+  sigfillset( &all);	// signals are for the cpu loop and the console
+  pthread_sigmask( SIG_SETMASK, &all, &old);
+  err = pthread_create( &thread, NULL, hostio_loop, NULL);
+  pthread_sigmask( SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+	printf( "Can't start the host I/O thread\n");
+	return 0;
+  }
+  pthread_detach( thread);
+  return 1;
+}
+
+static int hostio_add( struct HostPort *port, int fd, int outfd, int listenfd) {
+  if (epfd < 0 && !hostio_start())
+	return 0;
+  memset( port, 0, sizeof( struct HostPort));
+  port->fd = fd;
+  port->outfd = outfd;
+  port->listenfd = listenfd;
+  pthread_mutex_lock( &lock);
+  port->next = ports;
+  ports = port;
+  pthread_mutex_unlock( &lock);
+  return 1;
+}
+
+// serve a port reading fd, and writing outfd or fd if outfd is -1,
+// returns 0 on error
+int hostio_watch( struct HostPort *port, int fd, int outfd) {
+  struct epoll_event ev;
+  int err = 0;
+
+  if (!hostio_add( port, fd, outfd, -1))
+	return 0;
+  pthread_mutex_lock( &lock);
+  ev.events = EPOLLIN;
+  ev.data.ptr = port;
+  if (epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	if (errno != EPERM)
+	  err = errno;
+	port->regular = 1;	// always ready, read as long as there is room
+  }
+  ev.events = 0;
+  ev.data.ptr = (char *)port + OUTTAG;
+  if (!err && outfd >= 0 && epoll_ctl( epfd, EPOLL_CTL_ADD, outfd, &ev) < 0) {
+	if (errno != EPERM)
+	  err = errno;
+	port->outregular = 1;	// always ready, a write may block the thread
+  }
+  pthread_mutex_unlock( &lock);
+  if (err) {
+	printf( "Can't watch host port %d/%d (errno. %d)\n", fd, outfd, err);
+	return 0;
+  }
+  if (port->regular)
+	hostio_wake();
+  return 1;
+}
+
+// serve the clients connecting to listenfd, one at a time
+int hostio_listen( struct HostPort *port, int listenfd) {
+  struct epoll_event ev;
+
+  if (!hostio_add( port, -1, -1, listenfd))
+	return 0;
+  ev.events = EPOLLIN;
+  ev.data.ptr = port;
+  if (epoll_ctl( epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+	printf( "Can't watch socket %d (errno. %d)\n", listenfd, errno);
+	return 0;
+  }
+  return 1;
+}
+
+// queue output, returns the number of bytes taken : what doesn't fit has
+// to be written again later
+int hostio_write( struct HostPort *port, const uint8_t *buf, int len) {
+  uint32_t head, tail, pos, n;
+
+  head = atomic_load_explicit( &port->out.head, memory_order_relaxed);
+  tail = atomic_load_explicit( &port->out.tail, memory_order_acquire);
+  if (len > RING_SIZE - (head - tail))
+	len = RING_SIZE - (head - tail);
+  if (len <= 0)
+	return 0;
+  pos = head & (RING_SIZE - 1);
+  n = RING_SIZE - pos < len ? RING_SIZE - pos : len;
+  memcpy( port->out.data + pos, buf, n);
+  memcpy( port->out.data, buf + n, len - n);
+  atomic_store_explicit( &port->out.head, head + len, memory_order_release);
+  if (!atomic_exchange( &port->queued, 1))
+	hostio_wake();
+  return len;
+}
+
+// the console takes stdin (hold = 1) or gives it back to the devices
+void hostio_console( int hold) {
+  atomic_store( &stdin_held, hold);
+  if (!hold && epfd >= 0)
+	hostio_wake();
+}
+
+// called by hostio_getc() when the thread waits for room in the ring
+void hostio_resume( struct HostPort *port) {
+  if (atomic_exchange( &port->stalled, 0))
+	hostio_wake();
+}
+
+// the cpu loop waits for input on port : sleep up to ms milliseconds,
+// until something is received on any port
+void hostio_idle( struct HostPort *port, int ms) {
+  struct pollfd pfd;
+  uint64_t n;
+
+  if (cpufd < 0)
+	return;
+  atomic_store( &cpu_idle, 1);
+  // the thread may have filled the ring before seeing the flag
+  if (atomic_load( &port->in.head) == atomic_load( &port->in.tail)) {
+	pfd.fd = cpufd;
+	pfd.events = POLLIN;
+	poll( &pfd, 1, ms);
+  }
+  atomic_store( &cpu_idle, 0);
+  read( cpufd, &n, sizeof( n));
+}
+
+// have job run by the thread, the cpu loop going on meanwhile. It is run
+// here if there is no thread
+void hostio_post( struct HostJob *job) {
+  if (atomic_exchange( &job->posted, 1))
+	return;		// not started yet, it will see what was done until now
+  if (epfd < 0 && !hostio_start()) {
+	atomic_store( &job->posted, 0);
+	job->run( job->arg);
+	return;
+  }
+  pthread_mutex_lock( &lock);
+  job->next = jobs;
+  jobs = job;
+  pthread_mutex_unlock( &lock);
+  hostio_wake();
+}
+
+// wait up to ms milliseconds for the output queued to be written
+void hostio_sync( int ms) {
+  struct timespec t = { 0, 1000000 };
+  struct HostPort *port;
+  int busy;
+
+  for (; ms > 0 && epfd >= 0; ms--) {
+	busy = 0;
+	pthread_mutex_lock( &lock);
+	for (port = ports; port != NULL; port = port->next)
+	  if (atomic_load( &port->out.head) != atomic_load( &port->out.tail)
+		  && (port->outfd >= 0 || atomic_load( &port->fd) >= 0))
+		busy = 1;
+	pthread_mutex_unlock( &lock);
+	if (!busy)
+	  return;
+	nanosleep( &t, NULL);
+  }
+}
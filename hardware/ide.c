@@ -0,0 +1,668 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4:
+   ide.c -- emulation of an IDE / CompactFlash block controller
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _XOPEN_SOURCE 500
+
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../emu/config.h"
+#include "../emu/emu6809.h"
+#include "hardware.h"
+
+#define IDE_SECSIZE 512
+#define IDE_CACHE 2048			// sectors cached by drive (1 MB)
+#define IDE_FLUSHDELAY 1000000	// cycles between a write and its flush
+#define IDE_HEADS 16			// geometry seen in CHS mode
+#define IDE_SPT 63
+
+// status register
+#define IDE_BSY 0x80
+#define IDE_DRDY 0x40
+#define IDE_DSC 0x10
+#define IDE_DRQ 0x08
+#define IDE_ERR 0x01
+
+// error register
+#define IDE_IDNF 0x10			// sector out of the disk
+#define IDE_ABRT 0x04			// command refused
+
+/*
+   The task file of an ATA disk on 8 consecutive addresses, as wired by
+   the usual 8 bit IDE and CompactFlash adapters of 6809 systems :
+     0 : data                  4 : LBA 8-15  (cylinder low)
+     1 : error / features      5 : LBA 16-23 (cylinder high)
+     2 : sector count          6 : device, bit 6 LBA, bit 4 drive 1,
+     3 : LBA 0-7 (sector)          bits 0-3 LBA 24-27 (head)
+                               7 : status / command
+   Drives 0 and 1 each get a raw image of 512 bytes sectors, of any size.
+   An image "name@<size>" is created sparse, or grown, to <size> sectors
+   (or K, M, G bytes with the suffix). Without LBA, addresses are taken as
+   cylinder / head / sector of IDE_HEADS heads and IDE_SPT sectors.
+   Commands READ SECTORS (0x20), WRITE SECTORS (0x30) and READ VERIFY (0x40)
+   move count sectors (256 if 0) from the address, each through the 512
+   bytes buffer read or written at the data register, DRQ being set while
+   the buffer waits for the cpu. The task file is left on the last sector.
+   IDENTIFY DEVICE (0xEC), SET FEATURES (0xEF), FLUSH CACHE (0xE7),
+   INITIALIZE DEVICE PARAMETERS (0x91), RECALIBRATE (0x1x) and SEEK (0x70)
+   are also known, others are aborted. Commands complete at once; INTRQ
+   is raised on the interrupt line, if any, each time a sector is ready to
+   be read, or has been written, and held until the status is read or the
+   next command written.
+   The images are read and written with pread/pwrite through a cache of
+   IDE_CACHE sectors per drive, direct mapped so that consecutive sectors
+   stay together : sectors written are sent to the image in runs,
+   IDE_FLUSHDELAY cycles after the first write, on FLUSH CACHE, when they
+   leave the cache and at exit. "cache <n>" changes the size of the cache,
+   "readonly" refuses the writes.
+   Ex: ide E060 IRQ os9.img
+       ide E060 cache 8192 flex.img@64M work.img@128M
+*/
+
+struct IdeSlot {
+	int32_t lba;			// sector held, -1 if none
+	uint8_t dirty;			// not yet in the image
+};
+
+struct IdeDrive {
+	int fd;					// image, -1 if no drive
+	int readonly;
+	uint32_t nsec;			// sectors in the image
+	char *name;
+	int nslots;
+	struct IdeSlot *slot;
+	uint8_t *data;			// nslots sectors of the cache
+	int ndirty;
+	long hits, misses;		// cache statistics
+};
+
+struct Ide {
+	uint8_t error;
+	uint8_t features;
+	uint8_t count;
+	uint8_t lba0;
+	uint8_t lba1;
+	uint8_t lba2;
+	uint8_t dev;
+	uint8_t status;
+	uint8_t cmd;
+	uint8_t data;
+	int16_t pos;			// next byte in buf, -1 if no transfer
+	uint16_t left;			// sectors to transfer, this one included
+	uint32_t lba;			// sector transfered
+	uint8_t intrq;			// INTRQ held until the status is read
+	uint8_t buf[IDE_SECSIZE];
+	// host side
+	struct IdeDrive drive[2];
+	long flush;				// time to flush the sectors written
+	struct Ide *next;
+};
+
+static struct Ide *ides = NULL;	// controllers, flushed at exit
+
+static struct IdeDrive *ide_drive( struct Ide *ide) {
+	return &ide->drive[(ide->dev >> 4) & 1];
+}
+
+// the interrupt is raised by ide_run while INTRQ holds
+static void ide_intrq( struct Device *dev) {
+	((struct Ide *)dev->registers)->intrq = 1;
+	dev_deadline = 0;
+}
+
+// write the sectors of slots from to to-1, consecutive in the image
+static void ide_writerun( struct IdeDrive *drv, int from, int to) {
+	ssize_t len = (ssize_t)(to - from) * IDE_SECSIZE;
+
+	if (pwrite( drv->fd, drv->data + (size_t)from * IDE_SECSIZE, len,
+			(off_t)drv->slot[from].lba * IDE_SECSIZE) != len)
+	  printf( "%s: write error at sector %d (%s)\n", drv->name,
+		drv->slot[from].lba, strerror( errno));
+	for (; from < to; from++)
+	  drv->slot[from].dirty = 0;
+}
+
+// send the sectors written to the image, by runs of consecutive ones
+static void ide_flushdrive( struct IdeDrive *drv) {
+	int n, first;
+
+	if (drv->ndirty == 0)
+	  return;
+	for (n = 0; n < drv->nslots; ) {
+	  if (!drv->slot[n].dirty) {
+		n++;
+		continue;
+	  }
+	  first = n++;
+	  while (n < drv->nslots && drv->slot[n].dirty
+			&& drv->slot[n].lba == drv->slot[n-1].lba + 1)
+		n++;
+	  ide_writerun( drv, first, n);
+	}
+	drv->ndirty = 0;
+}
+
+static void ide_flush( struct Ide *ide) {
+	ide->flush = LONG_MAX;
+	ide_flushdrive( &ide->drive[0]);
+	ide_flushdrive( &ide->drive[1]);
+}
+
+static void ide_exit( void) {
+	struct Ide *ide;
+	int n;
+
+	for (ide = ides; ide != NULL; ide = ide->next) {
+	  ide_flush( ide);
+	  for (n = 0; n < 2; n++)
+		if (ide->drive[n].fd >= 0 && !ide->drive[n].readonly)
+		  fsync( ide->drive[n].fd);
+	}
+}
+
+// the sector lba in the cache, read from the image if fill is set
+static uint8_t *ide_cached( struct IdeDrive *drv, uint32_t lba, int fill) {
+	int n = lba % drv->nslots;
+	struct IdeSlot *slot = &drv->slot[n];
+	uint8_t *p = drv->data + (size_t)n * IDE_SECSIZE;
+	ssize_t got;
+
+	if (slot->lba == (int32_t)lba) {
+	  drv->hits++;
+	  return p;
+	}
+	drv->misses++;
+	if (slot->dirty) {
+	  ide_writerun( drv, n, n+1);
+	  drv->ndirty--;
+	}
+	slot->lba = lba;
+	if (fill) {
+	  got = pread( drv->fd, p, IDE_SECSIZE, (off_t)lba * IDE_SECSIZE);
+	  if (got < 0) {
+		printf( "%s: read error at sector %d (%s)\n", drv->name, lba, strerror( errno));
+		got = 0;
+	  }
+	  memset( p + got, 0, IDE_SECSIZE - got);	// past the end of a sparse image
+	}
+	return p;
+}
+
+// sector addressed by the task file
+static uint32_t ide_getlba( struct Ide *ide) {
+	if (ide->dev & 0x40)
+	  return (uint32_t)(ide->dev & 0x0f) << 24 | ide->lba2 << 16
+		| ide->lba1 << 8 | ide->lba0;
+	return ((uint32_t)(ide->lba2 << 8 | ide->lba1) * IDE_HEADS + (ide->dev & 0x0f))
+		* IDE_SPT + ide->lba0 - 1;
+}
+
+static void ide_setlba( struct Ide *ide, uint32_t lba) {
+	uint32_t cyl;
+
+	if (ide->dev & 0x40) {
+	  ide->lba0 = lba;
+	  ide->lba1 = lba >> 8;
+	  ide->lba2 = lba >> 16;
+	  ide->dev = (ide->dev & 0xf0) | ((lba >> 24) & 0x0f);
+	} else {
+	  cyl = lba / (IDE_HEADS * IDE_SPT);
+	  ide->lba0 = lba % IDE_SPT + 1;
+	  ide->lba1 = cyl;
+	  ide->lba2 = cyl >> 8;
+	  ide->dev = (ide->dev & 0xf0) | ((lba / IDE_SPT) % IDE_HEADS);
+	}
+}
+
+static void ide_abort( struct Ide *ide, uint8_t error) {
+	ide->error = error;
+	ide->status = IDE_DRDY | IDE_DSC | IDE_ERR;
+	ide->pos = -1;
+}
+
+// next sector of a transfer : in the buffer for a read, DRQ for a write
+static void ide_sector( struct Device *dev, struct Ide *ide) {
+	struct IdeDrive *drv = ide_drive( ide);
+
+	ide_setlba( ide, ide->lba);
+	ide->count = ide->left;
+	ide->pos = 0;
+	ide->status = IDE_DRDY | IDE_DSC | IDE_DRQ;
+	if (ide->cmd == 0x20) {
+	  memcpy( ide->buf, ide_cached( drv, ide->lba, 1), IDE_SECSIZE);
+	  ide_intrq( dev);
+	}
+}
+
+// the buffer was read or filled by the cpu
+static void ide_done( struct Device *dev, struct Ide *ide) {
+	struct IdeDrive *drv = ide_drive( ide);
+	struct IdeSlot *slot;
+
+	if (ide->cmd == 0x30) {
+	  memcpy( ide_cached( drv, ide->lba, 0), ide->buf, IDE_SECSIZE);
+	  slot = &drv->slot[ide->lba % drv->nslots];
+	  if (!slot->dirty) {
+		slot->dirty = 1;
+		drv->ndirty++;
+	  }
+	  if (ide->flush == LONG_MAX) {
+		ide->flush = cycles + IDE_FLUSHDELAY;
+		dev_deadline = 0;
+	  }
+	}
+	if (ide->cmd == 0x30 || ide->cmd == 0x20) {
+	  if (--ide->left > 0) {
+		ide->lba++;
+		ide_sector( dev, ide);
+		if (ide->cmd == 0x30)
+		  ide_intrq( dev);
+		return;
+	  }
+	  ide->count = 0;
+	}
+	ide->pos = -1;
+	ide->status = IDE_DRDY | IDE_DSC;
+	if (ide->cmd == 0x30)
+	  ide_intrq( dev);
+}
+
+// ATA strings have two characters by word, the first in the high byte
+static void ide_string( uint8_t *p, char *s, int len) {
+	int n;
+
+	for (n = 0; n < len; n++)
+	  p[n ^ 1] = *s ? *s++ : ' ';
+}
+
+static void ide_word( uint8_t *p, int word, uint16_t val) {
+	p[word * 2] = val;
+	p[word * 2 + 1] = val >> 8;
+}
+
+static void ide_identify( struct Ide *ide) {
+	struct IdeDrive *drv = ide_drive( ide);
+	uint32_t cyls = drv->nsec / (IDE_HEADS * IDE_SPT);
+	char model[41];
+	char *base;
+
+	if (cyls > 16383)
+	  cyls = 16383;
+	memset( ide->buf, 0, IDE_SECSIZE);
+	ide_word( ide->buf, 0, 0x0040);			// fixed disk
+	ide_word( ide->buf, 1, cyls);
+	ide_word( ide->buf, 3, IDE_HEADS);
+	ide_word( ide->buf, 6, IDE_SPT);
+	ide_string( ide->buf + 20, "SIM6809", 20);
+	ide_string( ide->buf + 46, "1.0", 8);
+	base = strrchr( drv->name, '/');
+	snprintf( model, sizeof( model), "SIM6809 %s", base != NULL ? base+1 : drv->name);
+	ide_string( ide->buf + 54, model, 40);
+	ide_word( ide->buf, 47, 0x8001);		// 1 sector by block
+	ide_word( ide->buf, 49, 0x0200);		// LBA
+	ide_word( ide->buf, 53, 0x0001);
+	ide_word( ide->buf, 54, cyls);
+	ide_word( ide->buf, 55, IDE_HEADS);
+	ide_word( ide->buf, 56, IDE_SPT);
+	ide_word( ide->buf, 57, cyls * IDE_HEADS * IDE_SPT);
+	ide_word( ide->buf, 58, (cyls * IDE_HEADS * IDE_SPT) >> 16);
+	ide_word( ide->buf, 60, drv->nsec);
+	ide_word( ide->buf, 61, drv->nsec >> 16);
+	ide_word( ide->buf, 82, 0x0020);		// write cache
+	ide_word( ide->buf, 83, 0x7000);		// FLUSH CACHE
+	ide_word( ide->buf, 85, 0x0020);
+	ide_word( ide->buf, 86, 0x3000);
+	ide->pos = 0;
+	ide->status = IDE_DRDY | IDE_DSC | IDE_DRQ;
+}
+
+static void ide_command( struct Device *dev, struct Ide *ide, uint8_t cmd) {
+	struct IdeDrive *drv = ide_drive( ide);
+	uint32_t lba;
+
+	if (drv->fd < 0)		// no drive to answer
+	  return;
+	ide->error = 0;
+	ide->pos = -1;
+	ide->status = IDE_DRDY | IDE_DSC;
+	switch (cmd) {
+	  case 0x20 : case 0x21 :			// READ SECTORS (with retry or not)
+	  case 0x30 : case 0x31 :			// WRITE SECTORS
+	  case 0x40 : case 0x41 :			// READ VERIFY SECTORS
+		lba = ide_getlba( ide);
+		ide->left = ide->count ? ide->count : 256;
+		if (lba >= drv->nsec || drv->nsec - lba < ide->left) {
+		  ide_abort( ide, IDE_IDNF);
+		  break;
+		}
+		ide->cmd = cmd & 0xfe;
+		if (ide->cmd == 0x30 && drv->readonly) {
+		  ide_abort( ide, IDE_ABRT);
+		  break;
+		}
+		if (ide->cmd == 0x40) {			// nothing to move
+		  ide_setlba( ide, lba + ide->left - 1);
+		  ide->count = 0;
+		  ide_intrq( dev);
+		  break;
+		}
+		ide->lba = lba;
+		ide_sector( dev, ide);
+		break;
+	  case 0xec :						// IDENTIFY DEVICE
+		ide->cmd = cmd;
+		ide_identify( ide);
+		ide_intrq( dev);
+		break;
+	  case 0xe7 : case 0xea :			// FLUSH CACHE
+		ide_flush( ide);
+		ide_intrq( dev);
+		break;
+	  case 0xef :						// SET FEATURES
+		switch (ide->features) {
+		  case 0x01 : case 0x81 :		// 8 bit transfers : always
+		  case 0x02 : case 0x82 :		// write cache : always
+		  case 0x03 :					// transfer mode : any
+		  case 0x55 : case 0xaa :		// read look ahead : always
+			break;
+		  default :
+			ide_abort( ide, IDE_ABRT);
+			return;
+		}
+		ide_intrq( dev);
+		break;
+	  case 0xe5 :						// CHECK POWER MODE : active
+		ide->count = 0xff;
+		ide_intrq( dev);
+		break;
+	  case 0xe0 : case 0xe1 : case 0xe2 : case 0xe3 :	// power modes, ignored
+	  case 0x91 :						// INITIALIZE DEVICE PARAMETERS
+	  case 0x70 :						// SEEK
+		ide_intrq( dev);
+		break;
+	  default :
+		if ((cmd & 0xf0) == 0x10) {		// RECALIBRATE
+		  ide_intrq( dev);
+		  break;
+		}
+		ide_abort( ide, IDE_ABRT);
+		ide_intrq( dev);
+	}
+}
+
+// Initialisation at reset
+void ide_reset( struct Device *dev) {
+	struct Ide *ide;
+
+	ide = dev->registers;
+	ide->error = 0x01;		// diagnostic passed
+	ide->features = 0;
+	ide->count = 1;
+	ide->lba0 = 1;
+	ide->lba1 = 0;
+	ide->lba2 = 0;
+	ide->dev = 0;
+	ide->cmd = 0;
+	ide->data = 0;
+	ide->pos = -1;
+	ide->left = 0;
+	ide->intrq = 0;
+	ide->status = IDE_DRDY | IDE_DSC;
+}
+
+// open the image of a drive, "name@<size>" creating or growing it
+static int ide_open( struct IdeDrive *drv, char *name, int readonly, int nslots) {
+	struct stat st;
+	char *at, *end;
+	long long size = -1;
+	int n;
+
+	at = strrchr( name, '@');
+	if (at != NULL) {
+	  *at = '\0';
+	  size = strtoll( at+1, &end, 10);
+	  switch (*end) {
+		case 'k' : case 'K' : size <<= 10; break;
+		case 'm' : case 'M' : size <<= 20; break;
+		case 'g' : case 'G' : size <<= 30; break;
+		default : size *= IDE_SECSIZE;
+	  }
+	  if (size <= 0 || size / IDE_SECSIZE > 0x0fffffff) {
+		printf( "%s: invalid size %s\n", name, at+1);
+		return 0;
+	  }
+	  drv->fd = open( name, readonly ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+	} else {
+	  drv->fd = open( name, readonly ? O_RDONLY : O_RDWR);
+	  if (drv->fd < 0 && !readonly && (errno == EACCES || errno == EROFS)) {
+		drv->fd = open( name, O_RDONLY);
+		readonly = 1;
+	  }
+	}
+	if (drv->fd < 0 || fstat( drv->fd, &st) < 0) {
+	  printf( "%s: %s\n", name, strerror( errno));
+	  if (drv->fd >= 0)
+		close( drv->fd);
+	  drv->fd = -1;
+	  return 0;
+	}
+	if (size > st.st_size && !readonly) {
+	  if (ftruncate( drv->fd, size) < 0)
+		printf( "%s: can't grow to %lld bytes (%s)\n", name, size, strerror( errno));
+	  else
+		st.st_size = size;
+	}
+	drv->nsec = st.st_size / IDE_SECSIZE;
+	if (drv->nsec > 0x0fffffff)
+	  drv->nsec = 0x0fffffff;	// 28 bits LBA
+	if (drv->nsec == 0) {
+	  printf( "%s: image smaller than a sector\n", name);
+	  close( drv->fd);
+	  drv->fd = -1;
+	  return 0;
+	}
+	drv->readonly = readonly;
+	drv->name = strdup( name);
+	drv->nslots = nslots;
+	drv->slot = mmalloc( nslots * sizeof( struct IdeSlot));
+	for (n = 0; n < nslots; n++) {
+	  drv->slot[n].lba = -1;
+	  drv->slot[n].dirty = 0;
+	}
+	drv->data = mmalloc( (size_t)nslots * IDE_SECSIZE);
+	printf( "ide %s, %u sectors (%u MB), cache %d sectors %s\n", name,
+		drv->nsec, drv->nsec >> 11, nslots, readonly ? "(READONLY)" : "");
+	return 1;
+}
+
+// Creation of IDE controller
+// ide <adr> [IRQ|FIRQ|NMI] [cache <sectors>] [readonly] <image drive 0> [<image drive 1>]
+void ide_init( char* name, uint16_t adr, char *args) {
+	struct Device *new;
+	struct Ide *ide;
+	char int_line, *imgname;
+	int n = 0, readonly = 0, nslots = IDE_CACHE;
+
+	int_line = read_intline( &args);
+
+	// Create a device and allocate space for data
+	new = mmalloc( sizeof( struct Device));
+	strcpy( new->devname, name);
+	new->ops = &ide_ops;
+	new->addr = adr;
+	new->end = adr+8;
+	new->interrupt = int_line;
+	ide = mmalloc( sizeof( struct Ide));
+	memset( ide, 0, sizeof( struct Ide));
+	new->registers = ide;
+	ide->drive[0].fd = -1;
+	ide->drive[1].fd = -1;
+	ide->flush = LONG_MAX;
+
+	for (;;) {
+	  imgname = readstr( &args);
+	  if (*imgname == '\0' || *imgname == '#')
+		break;
+	  if (strcmp( imgname, "cache") == 0) {
+		nslots = atoi( readstr( &args));
+		if (nslots < 1) {
+		  printf( "Invalid cache size, %d sectors used\n", IDE_CACHE);
+		  nslots = IDE_CACHE;
+		}
+	  } else if (strcmp( imgname, "readonly") == 0)
+		readonly = 1;
+	  else if (n < 2)
+		ide_open( &ide->drive[n++], imgname, readonly, nslots);
+	  else
+		printf( "%s: only 2 drives on an IDE controller\n", imgname);
+	}
+	if (n == 0)
+	  printf( "No image for the IDE controller at %04X\n", adr);
+
+	if (ides == NULL)
+	  atexit( ide_exit);
+	ide->next = ides;
+	ides = ide;
+	dev_add( new);
+	ide_reset( new);
+}
+
+// handle reads
+uint8_t ide_read( struct Device *dev, uint16_t reg) {
+  struct Ide *ide;
+  ide = dev->registers;
+  switch( reg & 0x07) {
+	case 0x00 :
+	  if (ide->pos >= 0) {
+		ide->data = ide->buf[ide->pos++];
+		if (ide->pos == IDE_SECSIZE)
+		  ide_done( dev, ide);
+	  }
+	  return ide->data;
+	case 0x01 :
+	  return ide->error;
+	case 0x02 :
+	  return ide->count;
+	case 0x03 :
+	  return ide->lba0;
+	case 0x04 :
+	  return ide->lba1;
+	case 0x05 :
+	  return ide->lba2;
+	case 0x06 :
+	  return ide->dev | 0xa0;
+	case 0x07 :
+	  ide->intrq = 0;
+	  return ide_drive( ide)->fd >= 0 ? ide->status : 0x00;
+  }
+  return 0xff;
+}
+
+// handle writes
+void ide_write( struct Device *dev, uint16_t reg, uint8_t val) {
+  struct Ide *ide;
+  ide = dev->registers;
+  switch( reg & 0x07) {
+	case 0x00 :
+	  ide->data = val;
+	  if (ide->pos >= 0 && ide->cmd == 0x30) {
+		ide->buf[ide->pos++] = val;
+		if (ide->pos == IDE_SECSIZE)
+		  ide_done( dev, ide);
+	  }
+	  break;
+	case 0x01 :
+	  ide->features = val;
+	  break;
+	case 0x02 :
+	  ide->count = val;
+	  break;
+	case 0x03 :
+	  ide->lba0 = val;
+	  break;
+	case 0x04 :
+	  ide->lba1 = val;
+	  break;
+	case 0x05 :
+	  ide->lba2 = val;
+	  break;
+	case 0x06 :
+	  ide->dev = val & 0x5f;
+	  break;
+	case 0x07 :
+	  ide->intrq = 0;
+	  ide_command( dev, ide, val);
+	  break;
+  }
+}
+
+// the sectors written are due to be flushed, INTRQ being raised while it
+// holds
+void ide_run( struct Device *dev) {
+  struct Ide *ide;
+  ide = dev->registers;
+  if (ide->flush <= cycles)
+	ide_flush( ide);
+  if (ide->intrq)
+	switch (dev->interrupt) {
+	  case 'F': firq(); break;
+	  case 'I': irq(); break;
+	  case 'N': nmi();
+	  default: break;
+	}
+}
+
+long ide_next_deadline( struct Device *dev) {
+  struct Ide *ide;
+  ide = dev->registers;
+  if (ide->intrq)
+	return cycles;
+  return ide->flush;
+}
+
+void ide_reg( struct Device *dev) {
+  struct Ide *ide;
+  struct IdeDrive *drv;
+  int n;
+  ide = dev->registers;
+  drv = ide_drive( ide);
+  printf( "ST:%02X,ER:%02X,CMD:%02X, count=%d, %s %d, drive %d, data:%02X\n",
+	ide->status, ide->error, ide->cmd, ide->count,
+	ide->dev & 0x40 ? "lba" : "chs", ide_getlba( ide), (ide->dev >> 4) & 1,
+	ide->data);
+  if (ide->pos >= 0)
+	printf( "  byte %d of sector %u, %d sectors left\n", ide->pos, ide->lba, ide->left);
+  for (n = 0; n < 2; n++) {
+	drv = &ide->drive[n];
+	if (drv->fd >= 0)
+	  printf( "  drive %d '%s' %u sectors, cache %ld hits %ld misses, %d dirty\n",
+		n, drv->name, drv->nsec, drv->hits, drv->misses, drv->ndirty);
+  }
+}
+
+const struct DevOps ide_ops = {
+	ide_init, ide_reset, ide_read, ide_write,
+	ide_run, ide_next_deadline, ide_reg
+};
@@ -31,6 +31,7 @@
 #include <errno.h>
 
 #include <stdlib.h>
+#include <limits.h>
 #include "../emu/config.h"
 #include "../emu/emu6809.h"
 #include "hardware.h"
@@ -81,21 +82,20 @@ void mc6820_reset( struct Device *dev) {
 }
 
 // Creation of PIA
-void mc6820_init( char* name, uint16_t adr, char int_line) {
+void mc6820_init( char* name, uint16_t adr, char *args) {
 	struct Device *new;
 	struct Pia *pia;
 
 	// Create a device and allocate space for data
 	new = mmalloc( sizeof( struct Device));
 	strcpy( new->devname, name);
-	new->type = MC6820;
+	new->ops = &mc6820_ops;
 	new->addr = adr;
 	new->end = adr+4;
-	new->interrupt = int_line;
+	new->interrupt = read_intline( &args);
 	pia = mmalloc( sizeof( struct Pia));
 	new->registers = pia;
-	new->next = devices;
-	devices = new;
+	dev_add( new);
 	mc6820_reset( new);
 }
 
@@ -183,3 +183,15 @@ void mc6820_reg( struct Device *dev) {
   printf( "\n           CRB:%02X, DDRB:%02X, ORB:%02X, PIBB:%02X, CB2:%02X\n",
 	pia->crb, pia->ddrb, pia->orb, pia->pibb, pia->cb2);
 }
+
+// pulses on CA2 or CB2 pending
+long mc6820_deadline( struct Device *dev) {
+  struct Pia *pia;
+  pia = dev->registers;
+  return (pia->setca2 || pia->setcb2) ? cycles : LONG_MAX;
+}
+
+const struct DevOps mc6820_ops = {
+	mc6820_init, mc6820_reset, mc6820_read, mc6820_write,
+	mc6820_run, mc6820_deadline, mc6820_reg
+};
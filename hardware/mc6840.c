@@ -30,6 +30,7 @@
 #include <errno.h>
 
 #include <stdlib.h>
+#include <limits.h>
 #include "../emu/config.h"
 #include "../emu/emu6809.h"
 #include "hardware.h"
@@ -50,62 +51,236 @@
 #define TIMER_T3L 7
 #define TIMER_LSB3 7
 
+// control register bits
+#define TIMER_RESET 0x01	// CR1 : all counters held preset
+#define TIMER_SEL1 0x01		// CR2 : register 0 is CR1, else CR3
+#define TIMER_DIV8 0x01		// CR3 : clock of timer 3 divided by 8
+#define TIMER_ECLK 0x02		// internal clock, else Cx which is not wired
+#define TIMER_DUAL 0x04		// two 8 bits counters
+#define TIMER_CMP 0x08		// frequency or pulse width comparison
+#define TIMER_NOINIT 0x10	// continuous and single shot : no init on latch write
+#define TIMER_WIDTH 0x10	// comparison : pulse width, else frequency
+#define TIMER_SHOT 0x20		// single shot, comparison : interrupt if t > tO
+#define TIMER_IRQEN 0x80
+
+struct Counter {
+	uint16_t latch;
+	uint16_t count;			// value at since
+	int64_t since;			// cycle of count, counting from there if run
+	int64_t due;			// next time out, LONG_MAX if not counting
+	uint8_t run;
+	uint8_t timedout;		// comparison : time out since the initialization
+};
+
 struct Timer {
-	uint8_t cr1;
-	uint8_t cr2;
-	uint8_t cr3;
+	uint8_t cr[3];
 	uint8_t sr;
-	uint16_t timer1;
-	uint16_t timer2;
-	uint16_t timer3;
-	uint16_t latch1;
-	uint16_t latch2;
-	uint16_t latch3;
-	uint32_t cycles_t1_last;
-	uint32_t cycles_t2_last;
-	uint32_t cycles_t3_last;
-} ;
-
+	uint8_t msb;			// MSB buffer, written before a latch
+	uint8_t lsb;			// LSB buffer, read after a counter
+	uint8_t srread;			// flags seen by the last status read
+	uint8_t gate;			// bit n : gate of timer n+1 high
+	struct Counter t[3];
+};
 
 /*
-   The 6840 TIMER is not fully implemented. Only the continuous operating mode
-   and the sigle shot mode are implemented, with interrupt management.
-   Frequency and pulse width can't be managed without hardware...
+   The counters are not decremented : each one keeps its value at the
+   cycle it was initialized, or its clock last changed, and what it holds
+   later is computed from the cycles elapsed when it is read. The next time
+   out is known in advance, and is the deadline of the device when its
+   interrupt is enabled, so that a timer costs nothing between them.
+   Continuous and single shot modes, in 16 bits or dual 8 bits, set the
+   flag of the timer at each time out (single shot only differs by its
+   output, which is not wired). The gates are low unless driven by
+   mc6840_gate() : the comparison modes start the counter on a falling
+   edge and look at the time out on the next falling edge (frequency) or
+   the rising one (pulse width). External clocks are not wired either, a
+   counter on Cx stays still.
 */
 
+// clock of a counter, in cpu cycles
+static int timer_clock( struct Timer *timer, int n) {
+	return n == 2 && (timer->cr[2] & TIMER_DIV8) ? 8 : 1;
+}
+
+// clocks from a reload of the latch to the next one
+static long timer_period( struct Timer *timer, int n) {
+	uint16_t latch = timer->t[n].latch;
+
+	if (timer->cr[n] & TIMER_DUAL)
+	  return ((latch >> 8) + 1) * ((latch & 0xff) + 1);
+	return latch + 1L;
+}
+
+// clocks before the time out of a counter holding val
+static long timer_left( struct Timer *timer, int n, uint16_t val) {
+	if (timer->cr[n] & TIMER_DUAL)
+	  return (val >> 8) * ((timer->t[n].latch & 0xff) + 1L) + (val & 0xff) + 1;
+	return val + 1L;
+}
+
+// value of a counter left clocks before its time out
+static uint16_t timer_count( struct Timer *timer, int n, long left) {
+	long lsb = (timer->t[n].latch & 0xff) + 1;
+
+	if (timer->cr[n] & TIMER_DUAL)
+	  return ((left - 1) / lsb) << 8 | (left - 1) % lsb;
+	return left - 1;
+}
+
+// counter value at cycle now
+static uint16_t timer_value( struct Timer *timer, int n, int64_t now) {
+	struct Counter *t = &timer->t[n];
+	long k, left;
+
+	if (!t->run)
+	  return t->count;
+	k = (now - t->since) / timer_clock( timer, n);
+	left = timer_left( timer, n, t->count);
+	if (k < left)
+	  return timer_count( timer, n, left - k);
+	return timer_count( timer, n, timer_period( timer, n)
+		- (k - left) % timer_period( timer, n));
+}
+
+// the interrupt flag of the composite status follows the others
+static void timer_irq( struct Timer *timer) {
+	int n;
+
+	timer->sr &= 0x07;
+	for (n = 0; n < 3; n++)
+	  if ((timer->sr & (1 << n)) && (timer->cr[n] & TIMER_IRQEN))
+		timer->sr |= 0x80;
+}
+
+// counting or not, from now with the value it has
+static void timer_rebase( struct Timer *timer, int n, int64_t now) {
+	struct Counter *t = &timer->t[n];
+	uint8_t cr = timer->cr[n];
+
+	t->count = timer_value( timer, n, now);
+	t->since = now;
+	t->run = !(timer->cr[0] & TIMER_RESET) && (cr & TIMER_ECLK);
+	if (cr & TIMER_CMP) {
+	  if (t->timedout || ((cr & TIMER_WIDTH) && (timer->gate & (1 << n))))
+		t->run = 0;
+	} else if (timer->gate & (1 << n))
+	  t->run = 0;
+	t->due = t->run ? now + timer_left( timer, n, t->count) * timer_clock( timer, n)
+		: LONG_MAX;
+}
+
+// a control register changes, the counter keeping the value it has
+static void timer_control( struct Timer *timer, int n, uint8_t val, int64_t now) {
+	timer->t[n].count = timer_value( timer, n, now);
+	timer->t[n].since = now;
+	timer->cr[n] = val;
+	timer_rebase( timer, n, now);
+}
+
+// the counter is loaded from its latch
+static void timer_init( struct Timer *timer, int n, int64_t now) {
+	timer->t[n].count = timer->t[n].latch;
+	timer->t[n].run = 0;
+	timer->t[n].timedout = 0;
+	timer_rebase( timer, n, now);
+}
+
+// time outs up to now
+static void timer_update( struct Timer *timer, int64_t now) {
+	struct Counter *t;
+	long period;
+	int n;
+
+	for (n = 0; n < 3; n++) {
+	  t = &timer->t[n];
+	  if (t->due > now)
+		continue;
+	  if (timer->cr[n] & TIMER_CMP) {	// stops until the next initialization
+		t->count = 0;
+		t->run = 0;
+		t->timedout = 1;
+		t->due = LONG_MAX;
+		if (timer->cr[n] & TIMER_SHOT)	// t > tO
+		  timer->sr |= 1 << n;
+		continue;
+	  }
+	  timer->sr |= 1 << n;
+	  period = timer_period( timer, n) * timer_clock( timer, n);
+	  t->due += ((now - t->due) / period + 1) * period;
+	}
+	timer_irq( timer);
+}
+
+// a gate input changes : level 0 low, else high
+void mc6840_gate( struct Device *dev, int n, int level) {
+	struct Timer *timer = dev->registers;
+	struct Counter *t = &timer->t[n];
+	uint8_t cr = timer->cr[n], bit = 1 << n;
+
+	if (((timer->gate & bit) != 0) == (level != 0))
+	  return;
+	timer_update( timer, cycles);
+	if (level)
+	  timer->gate |= bit;
+	else
+	  timer->gate &= ~bit;
+	if (!(cr & TIMER_CMP)) {
+	  if (level)			// counting stops
+		timer_rebase( timer, n, cycles);
+	  else					// a falling edge initializes
+		timer_init( timer, n, cycles);
+	} else if (!level) {
+	  // frequency : a period shorter than the time out
+	  if (!(cr & TIMER_WIDTH) && !(cr & TIMER_SHOT) && t->run)
+		timer->sr |= bit;
+	  timer_init( timer, n, cycles);
+	} else if (cr & TIMER_WIDTH) {
+	  // pulse width : a pulse shorter than the time out
+	  if (!(cr & TIMER_SHOT) && t->run)
+		timer->sr |= bit;
+	  timer_rebase( timer, n, cycles);
+	}
+	timer_irq( timer);
+	dev_deadline = 0;
+}
+
 // Timer initialisation after reset (soft or hard)
 void mc6840_reset( struct Device *dev) {
-// @TODO
+	struct Timer *timer;
+	int n;
+
+	timer = dev->registers;
+	memset( timer, 0, sizeof( struct Timer));
+	timer->cr[0] = TIMER_RESET;
+	for (n = 0; n < 3; n++) {
+	  timer->t[n].latch = 0xffff;
+	  timer_init( timer, n, cycles);
+	}
 }
 
 // Timer creation
-void mc6840_init( char* devname, uint16_t adr, char int_line) {
+void mc6840_init( char* devname, uint16_t adr, char *args) {
 	struct Device *new;
 	struct Timer *timer;
 
 	// Create a device and allocate space for data
 	new = mmalloc( sizeof( struct Device));
 	strcpy( new->devname, "MC6840");
-	new->type = MC6840;
+	new->ops = &mc6840_ops;
 	new->addr = adr;
 	new->end = adr+8;
-	new->interrupt = int_line;
+	new->interrupt = read_intline( &args);
 	timer = mmalloc( sizeof( struct Timer));
 	new->registers = timer;
-	new->next = devices;
-	devices = new;
+	dev_add( new);
 	mc6840_reset( new);
 }
 
 void mc6840_run( struct Device *dev) {
-	// call this every time around the loop
-	int i;
-	char buf;
 	struct Timer *timer;
 
 	timer = dev->registers;
-	// @TODO : manage counter change at processor frequency (1Mhz)
-
+	timer_update( timer, cycles);
 
 	// An interrupt condition occured
 	if (timer->sr & 0x80) {
@@ -121,29 +296,31 @@ void mc6840_run( struct Device *dev) {
 // handle reads from TIMER registers
 uint8_t mc6840_read( struct Device *dev, uint16_t reg) {
   struct Timer *timer;
+  uint16_t val;
+  int n;
   timer = dev->registers;
+	timer_update( timer, cycles);
 	switch (reg & 0x07) {   // not fully mapped
 		case TIMER_SR:
+			timer->srread = timer->sr & 0x07;
 			return timer->sr;
 		case TIMER_T1C:
-			// clear interrupt flag if set after SR read
-			if (timer->sr & 0x01)
-			  timer->sr |= 0xfe;
-			return (timer->timer1 >> 8) & 0xff;
-		case TIMER_LSB1:
-			return (timer->timer1) & 0xff;
 		case TIMER_T2C:
-			if (timer->sr & 0x02)
-			  timer->sr |= 0xfd;
-			return (timer->timer2 >> 8) & 0xff;
-		case TIMER_LSB2:
-			return (timer->timer2) & 0xff;
 		case TIMER_T3C:
-			if (timer->sr & 0x04)
-			  timer->sr |= 0xfb;
-			return (timer->timer3 >> 8) & 0xff;
+			// clear the interrupt flag seen by the last status read
+			n = ((reg & 0x07) >> 1) - 1;
+			if (timer->srread & (1 << n)) {
+			  timer->sr &= ~(1 << n);
+			  timer->srread &= ~(1 << n);
+			  timer_irq( timer);
+			}
+			val = timer_value( timer, n, cycles);
+			timer->lsb = val & 0xff;
+			return val >> 8;
+		case TIMER_LSB1:
+		case TIMER_LSB2:
 		case TIMER_LSB3:
-			return (timer->timer3) & 0xff;
+			return timer->lsb;
 	}
 	return 0xff;	// maybe the bus floats
 }
@@ -151,27 +328,75 @@ uint8_t mc6840_read( struct Device *dev, uint16_t reg) {
 // handle writes to TIMER registers
 void mc6840_write( struct Device *dev, uint16_t reg, uint8_t val) {
   struct Timer *timer;
+  uint8_t old;
+  int n;
   timer = dev->registers;
+	timer_update( timer, cycles);
 	switch (reg & 0x07) {   // not fully mapped
 	  case TIMER_CR13:
-		if (timer->cr2 & 0x01)
-		  timer->cr1 = val;
-		else
-		  timer->cr3 = val;
+		if (!(timer->cr[1] & TIMER_SEL1)) {
+		  timer_control( timer, 2, val, cycles);
+		  break;
+		}
+		old = timer->cr[0];
+		timer_control( timer, 0, val, cycles);
+		if (val & TIMER_RESET) {
+		  if (!(old & TIMER_RESET))	// counters preset, flags cleared
+			timer->sr = 0;
+		  for (n = 0; n < 3; n++)
+			timer_init( timer, n, cycles);
+		} else if (old & TIMER_RESET)	// counting starts
+		  for (n = 1; n < 3; n++)
+			timer_rebase( timer, n, cycles);
 		break;
 	  case TIMER_CR2:
-		timer->cr2 = val;
+		timer_control( timer, 1, val, cycles);
+		break;
+	  case TIMER_MSB1:
+	  case TIMER_MSB2:
+	  case TIMER_MSB3:
+		timer->msb = val;
+		break;
+	  case TIMER_LSB1:
+	  case TIMER_LSB2:
+	  case TIMER_LSB3:
+		n = ((reg & 0x07) >> 1) - 1;
+		timer->t[n].latch = timer->msb << 8 | val;
+		timer->sr &= ~(1 << n);
+		if (!(timer->cr[n] & (TIMER_CMP | TIMER_NOINIT)))
+		  timer_init( timer, n, cycles);
 		break;
 	}
+	timer_irq( timer);
 }
 
 void mc6840_reg( struct Device *dev) {
   struct Timer *timer;
+  int n;
+  timer = dev->registers;
+  for (n = 0; n < 3; n++)
+	printf( "\n       Timer %d - CR%d:%02X, TIMER:%04X, LATCH%d:%04X,%s", n+1, n+1,
+		timer->cr[n], timer_value( timer, n, cycles), n+1, timer->t[n].latch,
+		timer->t[n].run ? "" : " stopped,");
+  printf( " SR:%02X\n", timer->sr);
+}
+
+// the next time out of a timer whose interrupt is enabled, or at once
+// while an interrupt condition holds
+long mc6840_deadline( struct Device *dev) {
+  struct Timer *timer;
+  long next = LONG_MAX;
+  int n;
   timer = dev->registers;
-  printf( "\n       Timer 1 - CR1:%02X, TIMER:%02X, LATCH1:%02X,",
-	  	timer->cr1, timer->timer1, timer->latch1);
-  printf( "\n       Timer 2 - CR2:%02X, TIMER:%02X, LATCH2:%02X,",
-		timer->cr2, timer->timer2, timer->latch2);
-  printf( "\n       Timer 3 - CR3:%02X, TIMER:%02X, LATCH3:%02X, SR:%02X)\n",
-		timer->cr3, timer->timer3, timer->latch3, timer->sr);
+  if (timer->sr & 0x80)
+	return cycles;
+  for (n = 0; n < 3; n++)
+	if ((timer->cr[n] & TIMER_IRQEN) && timer->t[n].due < next)
+	  next = timer->t[n].due;
+  return next;
 }
+
+const struct DevOps mc6840_ops = {
+	mc6840_init, mc6840_reset, mc6840_read, mc6840_write,
+	mc6840_run, mc6840_deadline, mc6840_reg
+};
@@ -20,7 +20,12 @@
 #define __USE_POSIX199309
 
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <time.h>
+#include <signal.h>
 
 #include <stdio.h>
 #include <fcntl.h>
@@ -33,27 +38,35 @@
 #include <errno.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include "../emu/config.h"
 #include "../emu/emu6809.h"
 #include "hardware.h"
 
-// ACIA_CLOCK : number of machine cycles needed for transmitting
-// or receiving one character.
-// If ACIA_CLOCK is not defined, this number is erived from the speed in bps.
-// To speed the simulation, a small number can be used...
-
-#define ACIA_CLOCK 0 // No wait for I/O
+// Character time : the speed in bps given in .sim6809.ini is the rate
+// with the usual divide by 16, so CR0-CR1 give speed * 16, speed or
+// speed / 4 bps. With CR2-CR4 (start, data, parity and stop bits) and
+// CPU_CLOCK, this gives the cycles needed to send or receive a character.
+// An ACIA configured "instant" takes no time, for faster simulation.
+
+// Output is buffered and handed to the I/O thread of hostio.c when the
+// buffer is full, when the guest polls for input with nothing left to send,
+// or ACIA_TXDELAY cycles after the first character buffered.
+// A guest polling in a tight loop for input that doesn't come is idle :
+// the cpu loop then sleeps until the host sends something, or at most
+// ACIA_IDLEWAIT ms, instead of using 100% cpu.
+
+#define ACIA_TXBUF 256
+#define ACIA_TXDELAY 20000
+#define ACIA_IDLEPOLLS 8	// status reads meaning the guest waits for input
+#define ACIA_IDLEGAP 100	// max cycles between the status reads of a loop
+#define ACIA_IDLESLEEP 256	// status reads before sleeping
+#define ACIA_IDLEWAIT 2
 
 // Input conversion from LF to CR to make Flex system working with return key
 
 #define FLEX
 
-// Avoid using 100%cpu while waiting for input (select unusable
-// since it returns allways 0 after testing a read on pts...
-// To be avoided since even with ACIA_CLOCK 0, the system is very slow
-
-// #define SLOWDOWN
-
 #define ACIA_CR 0
 #define ACIA_SR 0
 #define ACIA_TDR 1
@@ -71,50 +84,31 @@ struct Acia {
 	uint8_t sr;
 	uint8_t tdr;
 	uint8_t rdr;
-	uint32_t acia_cycles;	// number of cyles udes to transmit/receive a character
-	uint32_t acia_clock_r;	// next time we can read
-	uint32_t acia_clock_w;	// next time we can write 
+	int32_t speed;			// bps at divide by 16
+	int instant;			// no character time
+	int64_t acia_cycles;	// number of cyles used to transmit/receive a character
+	int64_t acia_clock_r;	// next time we can read
+	int64_t acia_clock_w;	// next time we can write 
+	int64_t deadline;		// next time mc6850_run() has something to do
+	// host side
+	struct HostPort port;	// served by the hostio thread
+	int pts;				// pty slave of the xterm backend, else -1
+	FILE *xterm_stdout;		// the xterm process
+	int txlen;				// characters waiting in txbuf
+	long tx_flush;			// time to write them
+	int idle_polls;			// status reads without transmission
+	long last_poll;			// cycle of the last one
+	uint8_t txbuf[ACIA_TXBUF];
 } ;
 
 char *ptsname(int);
 int grantpt(int), unlockpt(int);
-static int pts;
-static FILE *xterm_stdout;
-static FILE *acia_hardware;
-
-#ifdef SLOWDOWN
-static struct timespec delay, remain;
-extern int nanosleep( const struct timespec *delay, struct timespec *remain);
-#define SLOWDOWN_DELAY 50 // delay of 50 ns to avoid 100% CPU usage
-#endif
-
-void mc6850_init( char* devname, uint16_t adr, char int_line, int32_t speed) {
-	struct Device *new;
-	struct Acia *acia;
 
-	// Create a device and allocate space for data
-	new = mmalloc( sizeof( struct Device));
-	strcpy( new->devname, "MC6850");
-	new->type = MC6850;
-	new->addr = adr;
-	new->end = adr+2;
-	new->interrupt = int_line;
-	acia = mmalloc( sizeof( struct Acia));
-	new->registers = acia;
-	new->next = devices;
-	devices = new;
-
-	// Nb of cycles between characters function of speed in bps
-#ifdef ACIA_CLOCK
-	acia->acia_cycles = ACIA_CLOCK;
-#else
-	acia->acia_cycles = (int)((1e7/(float)(speed))+0.5);
-#endif
-	acia->acia_clock_r = cycles;	// start with a ready device
-	acia->acia_clock_w = cycles;	// start with a ready device
+static void acia_exit( void);
 
-// configure a pseudo terminal and print its name on the console
-	char *slavename;
+// configure a pseudo terminal used by an xterm
+static int acia_xterm( struct Acia *acia) {
+	int pts;
 
 	int ptmx = open("/dev/ptmx", O_RDWR | O_NOCTTY);
 //	printf ("ptmx = %d\n", ptmx);
@@ -159,9 +153,9 @@ void mc6850_init( char* devname, uint16_t adr, char int_line, int32_t speed) {
 
 // launch an xterm that uses the pseudo-terminal master we have opened
 	char xterm_cmd[160];
-	int count = sprintf(xterm_cmd, "xterm -bg black -fg green -fn \"-urw-nimbus mono-bold-r-normal--0-0-0-0-m-0-iso8859-1\" -S%s/%d", pts_name, ptmx);
-	xterm_stdout = popen(xterm_cmd, "r");
-	if (!xterm_stdout) {
+	sprintf(xterm_cmd, "xterm -bg black -fg green -fn \"-urw-nimbus mono-bold-r-normal--0-0-0-0-m-0-iso8859-1\" -S%s/%d", pts_name, ptmx);
+	acia->xterm_stdout = popen(xterm_cmd, "r");
+	if (!acia->xterm_stdout) {
 		printf("Failed to open xterm process. Aborting...\n");
 		ptmx = 0;
 		close(ptmx);
@@ -177,35 +171,256 @@ void mc6850_init( char* devname, uint16_t adr, char int_line, int32_t speed) {
 	write( pts, s3, strlen( s3));
 
 	char buf; // why pts input get something in the first 1/10 sec ?
-#ifdef SLOWDOWN
-	delay.tv_sec = 0;
-	delay.tv_nsec = 100000000;	// Wait 1/10 sec and empty input buffer
-	nanosleep( &delay, &remain);
-	delay.tv_nsec = SLOWDOWN_DELAY;
-#else
 	sleep( 1);
-#endif
 	while (read( pts, &buf, 1) > 0);
+	acia->pts = pts;
+	return hostio_watch( &acia->port, pts, -1);
+}
+
+// guest terminal on the simulator's own stdin / stdout,
+// stdin stays blocking for the console, it is only read when ready
+static int acia_stdio( struct Acia *acia) {
+	static int used = 0;
+
+	if (used) {
+		printf( "stdin/stdout already used by another ACIA\n");
+		return 0;
+	}
+	used = 1;
+	printf( "ACIA port: stdin/stdout\n");
+	return hostio_watch( &acia->port, 0, 1);
+}
+
+// input read from a file, output written to another one
+static int acia_files( struct Acia *acia, char *in, char *out) {
+	int fd, outfd;
+
+	if ((fd = open( in, O_RDONLY | O_NONBLOCK)) < 0) {
+		printf( "ACIA input %s unreachable\n", in);
+		return 0;
+	}
+	if ((outfd = open( out, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0644)) < 0) {
+		printf( "Can't create ACIA output %s\n", out);
+		close( fd);
+		return 0;
+	}
+	printf( "ACIA port: input %s, output %s\n", in, out);
+	return hostio_watch( &acia->port, fd, outfd);
+}
+
+// a server on a Unix domain socket (port = NULL) or on a localhost TCP port,
+// the guest terminal being the client that connects to it
+static int acia_socket( struct Acia *acia, char *path, int port) {
+	struct sockaddr_un un;
+	struct sockaddr_in inet;
+	int fd, on = 1;
+
+	if (path != NULL) {
+		memset( &un, 0, sizeof( un));
+		un.sun_family = AF_UNIX;
+		strncpy( un.sun_path, path, sizeof( un.sun_path) - 1);
+		unlink( path);
+		fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind( fd, (struct sockaddr *)&un, sizeof( un)) < 0) {
+			printf( "Can't create ACIA socket %s (errno. %d)\n", path, errno);
+			return 0;
+		}
+		printf( "ACIA port: socket %s\n", path);
+	} else {
+		memset( &inet, 0, sizeof( inet));
+		inet.sin_family = AF_INET;
+		inet.sin_port = htons( port);
+		inet.sin_addr.s_addr = htonl( INADDR_LOOPBACK);
+		fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd >= 0)
+			setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on));
+		if (fd < 0 || bind( fd, (struct sockaddr *)&inet, sizeof( inet)) < 0) {
+			printf( "Can't listen to ACIA port localhost:%d (errno. %d)\n", port, errno);
+			return 0;
+		}
+		printf( "ACIA port: localhost:%d\n", port);
+	}
+	listen( fd, 1);
+	signal( SIGPIPE, SIG_IGN);	// a client may leave while we write
+	return hostio_listen( &acia->port, fd);
+}
+
+void mc6850_reset( struct Device *dev);
+
+/* mc6850 <adr> [IRQ|FIRQ|NMI] [speed] [instant] [backend], backend being one of
+     xterm (default)      a pty shown in a new xterm
+     stdio                the simulator's stdin / stdout
+     file <in> <out>      input read from <in>, output written to <out>
+     unix <path>          listening on the Unix domain socket <path>
+     tcp <port>           listening on localhost:<port>
+   Each ACIA has its own host port, so several may be configured, all of
+   them being served by the hostio thread.
+   Ex: mc6850 E000 IRQ 19200 tcp 6809
+       mc6850 E004 IRQ 9600 instant file in.txt out.txt */
+void mc6850_init( char* devname, uint16_t adr, char *args) {
+	struct Device *new;
+	struct Acia *acia;
+	int32_t speed;
+	static int exit_set = 0;
+	char int_line, backend[16], path[256];
+	int ok, instant;
+
+	int_line = read_intline( &args);
+	if (more_params( &args) && isdigit( *args))
+	  speed = strtol( args, &args, 10);
+	else
+	  speed = 9600;
+	if (speed <= 0)
+	  speed = 9600;
+	instant = 0;
+	strcpy( backend, "xterm");
+	while (more_params( &args)) {
+	  strncpy( backend, readstr( &args), 15);
+	  backend[15] = 0;
+	  if (strcmp( backend, "instant") != 0)
+		break;
+	  instant = 1;
+	  strcpy( backend, "xterm");
+	}
+
+	// Create a device and allocate space for data
+	new = mmalloc( sizeof( struct Device));
+	strcpy( new->devname, "MC6850");
+	new->ops = &mc6850_ops;
+	new->addr = adr;
+	new->end = adr+2;
+	new->interrupt = int_line;
+	acia = mmalloc( sizeof( struct Acia));
+	new->registers = acia;
+	dev_add( new);
+
+	acia->speed = speed;
+	acia->instant = instant;
+	acia->pts = -1;
+	acia->xterm_stdout = NULL;
+	acia->txlen = 0;
+	acia->idle_polls = 0;
+	acia->last_poll = 0;
+	mc6850_reset( new);
+	if (!exit_set) {
+	  atexit( acia_exit);
+	  exit_set = 1;
+	}
+
+	if (strcmp( backend, "xterm") == 0)
+	  ok = acia_xterm( acia);
+	else if (strcmp( backend, "stdio") == 0)
+	  ok = acia_stdio( acia);
+	else if (strcmp( backend, "file") == 0) {
+	  strncpy( path, readstr( &args), 255);
+	  path[255] = 0;
+	  ok = acia_files( acia, path, readstr( &args));
+	} else if (strcmp( backend, "unix") == 0)
+	  ok = acia_socket( acia, readstr( &args), 0);
+	else if (strcmp( backend, "tcp") == 0)
+	  ok = acia_socket( acia, NULL, readint( &args));
+	else {
+	  printf( "Unknown ACIA backend '%s'\n", backend);
+	  ok = 0;
+	}
+	if (!ok)
+	  exit( 1);
 }
 
-void acia_destroy() {
-	pclose( xterm_stdout);
-	close(pts);
+// hand buffered output to the I/O thread, what it can't take stays buffered
+static void acia_flush( struct Acia *acia) {
+	int n;
+
+	if (acia->txlen == 0)
+	  return;
+	n = hostio_write( &acia->port, acia->txbuf, acia->txlen);
+	if (n <= 0)
+	  return;
+	acia->txlen -= n;
+	if (acia->txlen > 0)
+	  memmove( acia->txbuf, acia->txbuf + n, acia->txlen);
+	acia->tx_flush = cycles + ACIA_TXDELAY;
+}
+
+// character time for the current control register
+static void acia_timing( struct Acia *acia) {
+	static const int divide[4] = { 1, 16, 64, 0 };
+	static const int wordbits[8] = { 11, 11, 10, 10, 11, 10, 11, 11 };
+
+	if (acia->instant)
+	  acia->acia_cycles = 0;
+	else
+	  acia->acia_cycles = (int64_t)wordbits[(acia->cr >> 2) & 0x07] * CPU_CLOCK
+		  * divide[acia->cr & 0x03] / (16 * (int64_t)acia->speed);
+}
+
+// first of the times something is due : end of the character sent, time
+// a new character may be received, or output buffer to write
+static void acia_deadline( struct Acia *acia) {
+	int64_t t = INT64_MAX;
+
+	if ((acia->sr & 0x02) == 0)
+	  t = acia->acia_clock_w;
+	if ((acia->sr & 0x01) == 0 && acia->acia_clock_r < t)
+	  t = acia->acia_clock_r;
+	if (acia->txlen > 0 && acia->tx_flush < t)
+	  t = acia->tx_flush;
+	acia->deadline = t;
+}
+
+// write what is left at exit, with the character being sent
+static void acia_exit( void) {
+	struct Device *dev;
+	struct Acia *acia;
+
+	for (dev = devices; dev != NULL; dev = dev->next)
+	  if (dev->ops == &mc6850_ops) {
+		acia = dev->registers;
+		if ((acia->sr & 0x02) == 0 && acia->txlen < ACIA_TXBUF)
+		  acia->txbuf[acia->txlen++] = acia->tdr;
+		acia_flush( acia);
+	  }
+	hostio_sync( 1000);
+}
+
+void mc6850_reset( struct Device *dev) {
+	struct Acia *acia;
+
+	acia = dev->registers;
+	acia->cr = 0x03;	// master reset
+	acia->sr = 0x02;	// TDRE
+	acia->tdr = 0;
+	acia->rdr = 0;
+	acia_timing( acia);
+	acia->acia_clock_r = cycles;	// start with a ready device
+	acia->acia_clock_w = cycles;
+	acia_deadline( acia);
 }
 
 void mc6850_run( struct Device *dev) {
-	// call this every time around the loop
-	int i, n;
+	int i;
 	char buf;
 	struct Acia *acia;
 
 	acia = dev->registers;
+	if (cycles < acia->deadline)
+	  return;	// nothing to do yet
+
 	if (cycles >= acia->acia_clock_w) {	// something to do ?
 
 	// got a character to send?
 	  if ((acia->sr & 0x02) == 0) {
-		buf = acia->tdr;
-		write(pts, &buf, 1);
+		if (acia->txlen == ACIA_TXBUF)
+		  acia_flush( acia);
+		if (acia->txlen == ACIA_TXBUF) {
+		  acia->deadline = cycles;
+		  return;	// TDRE stays clear until the terminal takes more
+		}
+		if (acia->txlen == 0)
+		  acia->tx_flush = cycles + ACIA_TXDELAY;
+		acia->txbuf[acia->txlen++] = (acia->cr & 0x10) ? acia->tdr : acia->tdr & 0x7f;
+		if (acia->txlen == ACIA_TXBUF)
+		  acia_flush( acia);
 		acia->sr |= 0x02;
 		if ((acia->cr & 0x60) == 0x20) {
 			acia->sr |= 0x80;
@@ -216,21 +431,28 @@ void mc6850_run( struct Device *dev) {
 			  default: break;
 			}
 		}
+		acia_deadline( acia);
 		return;
 	  }
 	}
 	
-	if (cycles < acia->acia_clock_r) return;	// nothing to do yet
+	if (acia->txlen > 0 && cycles >= acia->tx_flush)
+	  acia_flush( acia);
+
+	if (cycles < acia->acia_clock_r) {
+	  acia_deadline( acia);
+	  return;	// nothing to do yet
+	}
 
 	// character ready in input buffer ?
 	if ((acia->sr & 0x01) == 0) {
-	  i = read(pts, &buf, 1);
-	  if(i > 0) {
+	  if ((i = hostio_getc( &acia->port)) >= 0) {
+		buf = i;
 #ifdef FLEX
 		if (buf == '\n')	// Unix to Flex conversion...
 		  buf = '\r';
 #endif
-		acia->rdr = buf;
+		acia->rdr = (acia->cr & 0x10) ? buf : buf & 0x7f;	// 7 bits words
 		acia->sr |= 0x01;
 		if (acia->cr & 0x80) {
 		  acia->sr |= 0x80;
@@ -241,13 +463,14 @@ void mc6850_run( struct Device *dev) {
 			default: break;
 		  }
 		}
-	  } else {
+	  } else
 		acia->sr &= 0xFE;
-#ifdef SLOWDOWN
-		nanosleep( &delay, &remain);
-#endif
-	  }
 	}
+	acia_deadline( acia);
+}
+
+long mc6850_deadline( struct Device *dev) {
+	return ((struct Acia *)dev->registers)->deadline;
 }
 
 // handle reads from ACIA registers
@@ -256,10 +479,22 @@ uint8_t mc6850_read( struct Device *dev, uint16_t reg) {
   acia = dev->registers;
 	switch (reg & 0x01) {   // not fully mapped
 	  case ACIA_SR:
+		if ((acia->sr & 0x03) == 0x02) {	// guest waits for input ?
+		  if (cycles - acia->last_poll > ACIA_IDLEGAP)
+			acia->idle_polls = 0;
+		  acia->last_poll = cycles;
+		  if (++acia->idle_polls >= ACIA_IDLEPOLLS && acia->txlen > 0)
+			acia_flush( acia);
+		  if (acia->idle_polls >= ACIA_IDLESLEEP && acia->txlen == 0) {
+			hostio_idle( &acia->port, ACIA_IDLEWAIT);
+			acia->idle_polls = 0;
+		  }
+		}
 		return acia->sr;
 	  case ACIA_RDR:
 		acia->sr &= 0x7e;	// clear IRQ, RDRF
 		acia->acia_clock_r = cycles + acia->acia_cycles;
+		acia_deadline( acia);
 		return acia->rdr;
 	}
 	return 0xff;	// maybe the bus floats
@@ -269,16 +504,23 @@ uint8_t mc6850_read( struct Device *dev, uint16_t reg) {
 void mc6850_write( struct Device *dev, uint16_t reg, uint8_t val) {
   struct Acia *acia;
   acia = dev->registers;
-	switch (reg & 0x01) {   // not fully mapped CR0->CR4 ignored
+	switch (reg & 0x01) {   // not fully mapped
 		case ACIA_CR:
 			acia->cr = val;
+			if ((val & 0x03) == 0x03) {	// master reset
+				acia->sr = 0x02;
+				acia->acia_clock_w = cycles;
+			}
+			acia_timing( acia);
 			break;
 		case ACIA_TDR:
 			acia->tdr = val;
+			acia->idle_polls = 0;
 			acia->acia_clock_w = cycles + acia->acia_cycles;
 			acia->sr &= 0x7d;	// clear IRQ, TDRE
 			break;
 	}
+	acia_deadline( acia);
 }
 
 void mc6850_reg( struct Device *dev) {
@@ -295,6 +537,12 @@ void mc6850_reg( struct Device *dev) {
 	tdr = '.';
   printf( "CR:%02X, SR:%02X, RDR:'%c' (Ox%02X), TDR:'%c' (Ox%02X)\n",
   		acia->cr, acia->sr, rdr, acia->rdr, tdr, acia->tdr);
-  printf( "                           read clock=%ld, write_clock=%ld, cycles=%ld\n",
-  		acia->acia_clock_r, acia->acia_clock_w, cycles);
+  printf( "                           %d cycles/char%s, read clock=%ld, write_clock=%ld, cycles=%ld\n",
+  		(int)acia->acia_cycles, acia->instant ? " (instant)" : "",
+		(long)acia->acia_clock_r, (long)acia->acia_clock_w, cycles);
 }
+
+const struct DevOps mc6850_ops = {
+	mc6850_init, mc6850_reset, mc6850_read, mc6850_write,
+	mc6850_run, mc6850_deadline, mc6850_reg
+};
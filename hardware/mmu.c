@@ -0,0 +1,162 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4:
+   mmu.c -- dynamic address translation (DAT / MMU) for 6809 systems
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _XOPEN_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include <stdlib.h>
+#include "../emu/config.h"
+#include "../emu/emu6809.h"
+#include "hardware.h"
+
+#define MMU_MAXTASKS 8
+
+struct Mmu {
+	int pagesize;		// 4K or 8K
+	int nslots;			// pages in 64K
+	int ntasks;
+	int writeonly;		// reads go to the memory below (SWTPC DAT)
+	uint8_t task;		// active task
+	uint8_t slot[MMU_MAXTASKS][16];	// physical page of each logical page
+};
+
+/*
+   Generic DAT / MMU : the 64K logical space is split in 4K or 8K pages, and
+   each page can be mapped anywhere in physical memory. Several tasks may hold
+   their own set of page registers, a task register selecting the active one.
+   Registers :
+     adr + task * nslots + page : physical page number for this logical page
+     adr + ntasks * nslots      : task register (only if more than one task)
+   Switching task only rewrites the 16 page pointers used by get_memb() and
+   set_memb(), translated accesses stay a single indexed load.
+   Ex: mmu FFF0 4 1 writeonly # SWTPC DAT, 16 x 4K pages, reads see the rom
+       mmu FFA0 8 2           # CoCo 3 like, 2 tasks of 8 x 8K pages + FFB0
+*/
+
+// load the page table with the active task
+static void mmu_task( struct Mmu *mmu) {
+	int i, n = mmu->pagesize >> 12;
+
+	for (i = 0; i < 16; i++)
+	  mem_map_page( i, (mmu->slot[mmu->task][i / n] * mmu->pagesize) + ((i % n) << 12));
+}
+
+// Initialisation at reset : identity mapping
+void mmu_reset( struct Device *dev) {
+	struct Mmu *mmu;
+	int t, i;
+
+	mmu = dev->registers;
+	for (t = 0; t < mmu->ntasks; t++)
+	  for (i = 0; i < mmu->nslots; i++)
+		mmu->slot[t][i] = i;
+	mmu->task = 0;
+	mmu_task( mmu);
+}
+
+// Creation of MMU
+void mmu_init( char* name, uint16_t adr, char *args) {
+	struct Device *new;
+	struct Mmu *mmu;
+	int pagesize, ntasks, writeonly;
+
+	pagesize = readhex( &args);
+	ntasks = readhex( &args);
+	if (ntasks == 0)
+	  ntasks = 1;
+	writeonly = strcmp( readstr( &args), "writeonly") == 0;
+
+	if (pagesize != 4 && pagesize != 8) {
+	  printf( "MMU page size must be 4 or 8 (K), using 4\n");
+	  pagesize = 4;
+	}
+	if (ntasks < 1 || ntasks > MMU_MAXTASKS) {
+	  printf( "MMU with 1 to %d tasks, using 1\n", MMU_MAXTASKS);
+	  ntasks = 1;
+	}
+
+	// Create a device and allocate space for data
+	new = mmalloc( sizeof( struct Device));
+	strcpy( new->devname, name);
+	new->ops = &mmu_ops;
+	new->addr = adr;
+	new->interrupt = 'X';
+	mmu = mmalloc( sizeof( struct Mmu));
+	new->registers = mmu;
+	mmu->pagesize = pagesize << 10;
+	mmu->nslots = 0x10000 / mmu->pagesize;
+	mmu->ntasks = ntasks;
+	mmu->writeonly = writeonly;
+	new->end = adr + ntasks * mmu->nslots + (ntasks > 1 ? 1 : 0);
+	dev_add( new);
+	mmu_reset( new);
+}
+
+// handle reads
+uint8_t mmu_read( struct Device *dev, uint16_t adr) {
+  struct Mmu *mmu;
+  int reg;
+
+  mmu = dev->registers;
+  if (mmu->writeonly)
+	return mem_read_under( adr);
+  reg = adr - dev->addr;
+  if (reg == mmu->ntasks * mmu->nslots)
+	return mmu->task;
+  return mmu->slot[reg / mmu->nslots][reg % mmu->nslots];
+}
+
+// handle writes
+void mmu_write( struct Device *dev, uint16_t adr, uint8_t val) {
+  struct Mmu *mmu;
+  int reg, task, page, i, n;
+
+  mmu = dev->registers;
+  reg = adr - dev->addr;
+  if (reg == mmu->ntasks * mmu->nslots) {
+	mmu->task = val % mmu->ntasks;
+	mmu_task( mmu);
+	return;
+  }
+  task = reg / mmu->nslots;
+  page = reg % mmu->nslots;
+  mmu->slot[task][page] = val;
+  if (task == mmu->task) {	// only the pages of this slot change
+	n = mmu->pagesize >> 12;
+	for (i = 0; i < n; i++)
+	  mem_map_page( page * n + i, val * mmu->pagesize + (i << 12));
+  }
+}
+
+void mmu_reg( struct Device *dev) {
+  struct Mmu *mmu;
+  int i;
+
+  mmu = dev->registers;
+  printf( "TASK:%d, %dK pages:", mmu->task, mmu->pagesize >> 10);
+  for (i = 0; i < mmu->nslots; i++)
+	printf( " %02X", mmu->slot[mmu->task][i]);
+  putchar( '\n');
+}
+
+const struct DevOps mmu_ops = {
+	mmu_init, mmu_reset, mmu_read, mmu_write,
+	NULL, NULL, mmu_reg
+};
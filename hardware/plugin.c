@@ -0,0 +1,170 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4:
+   plugin.c -- devices loaded from shared objects
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <dlfcn.h>
+
+#include <stdlib.h>
+#include "../emu/config.h"
+#include "../emu/emu6809.h"
+#include "hardware.h"
+#include "sim6809_plugin.h"
+
+/*
+   A plugin defines a device type : its read, write, reset and show
+   functions are those of the operations table of the type, a struct Device
+   beginning with a struct sim6809_device.
+   Callbacks asked by the plugin are delivered from device_run(), as is its
+   interrupt while the plugin holds the line up.
+*/
+
+struct Plugin {
+	const struct sim6809_plugin *exp;	// table exported by the plugin
+	struct DevOps ops;
+	struct Plugin *next;
+};
+
+struct PluginDev {
+	struct Device dev;		// first, seen by the plugin
+	struct Plugin *plugin;
+	long when;				// cycle of the next callback, LONG_MAX if none
+	int pending;			// interrupt line up, raised after each instruction
+};
+
+static struct Plugin *plugins = NULL;
+
+static int64_t host_cycles( void) {
+  return cycles;
+}
+
+static void host_schedule( struct Device *dev, int64_t cycle) {
+  ((struct PluginDev *)dev)->when = cycle;
+  dev_deadline = 0;
+}
+
+static void host_cancel( struct Device *dev) {
+  ((struct PluginDev *)dev)->when = LONG_MAX;
+}
+
+static void host_set_interrupt( struct Device *dev, int level) {
+  ((struct PluginDev *)dev)->pending = level != 0;
+  dev_deadline = 0;
+}
+
+static const struct sim6809_host host = {
+	SIM6809_PLUGIN_ABI, host_cycles, host_schedule, host_cancel,
+	host_set_interrupt, get_memb, set_memb
+};
+
+// Creation of a plugin device, devname is the keyword of the plugin
+static void plugin_init( char *devname, uint16_t adr, char *args) {
+	struct Plugin *p;
+	struct PluginDev *pd;
+	struct Device *new;
+
+	for (p = plugins; p != NULL; p = p->next)
+	  if (strcasecmp( p->exp->name, devname) == 0)
+		break;
+	if (p == NULL)
+	  return;
+
+	pd = mmalloc( sizeof( struct PluginDev));
+	memset( pd, 0, sizeof( struct PluginDev));
+	new = &pd->dev;
+	strncpy( new->devname, devname, 15);
+	new->ops = &p->ops;
+	new->addr = adr;
+	new->end = adr+1;
+	new->interrupt = read_intline( &args);
+	pd->plugin = p;
+	pd->when = LONG_MAX;
+	ignore_ws( &args);
+	if (!p->exp->create( new, &host, args)) {
+	  printf( "%s @ %04X not created\n", devname, adr);
+	  free( pd);
+	  return;
+	}
+	dev_add( new);
+	if (p->ops.reset != NULL)
+	  p->ops.reset( new);
+}
+
+static void plugin_run( struct Device *dev) {
+	struct PluginDev *pd = (struct PluginDev *)dev;
+	long when;
+
+	if (pd->when <= cycles) {
+	  when = pd->when;
+	  pd->when = LONG_MAX;	// callback() may schedule again
+	  if (pd->plugin->exp->callback != NULL)
+		pd->plugin->exp->callback( dev, when);
+	}
+	if (pd->pending)		// the line is up until the plugin clears it
+	  switch (dev->interrupt) {
+		case 'F': firq(); break;
+		case 'I': irq(); break;
+		case 'N': nmi();
+		default: break;
+	  }
+}
+
+static long plugin_deadline( struct Device *dev) {
+	struct PluginDev *pd = (struct PluginDev *)dev;
+
+	return pd->pending ? cycles : pd->when;
+}
+
+// load a plugin and register its device type, returns 0 on error
+int plugin_load( char *filename) {
+	const struct sim6809_plugin *exp;
+	struct Plugin *p;
+	void *handle;
+
+	if ((handle = dlopen( filename, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+	  printf( "plugin %s: %s\n", filename, dlerror());
+	  return 0;
+	}
+	exp = dlsym( handle, SIM6809_PLUGIN_SYMBOL);
+	if (exp == NULL || exp->abi != SIM6809_PLUGIN_ABI || exp->name == NULL
+		|| exp->create == NULL || exp->read == NULL || exp->write == NULL) {
+	  printf( "plugin %s: no valid %s (ABI %d expected)\n", filename,
+		  SIM6809_PLUGIN_SYMBOL, SIM6809_PLUGIN_ABI);
+	  dlclose( handle);
+	  return 0;
+	}
+
+	p = mmalloc( sizeof( struct Plugin));
+	p->exp = exp;
+	p->ops.init = plugin_init;
+	p->ops.reset = exp->reset;
+	p->ops.read = exp->read;
+	p->ops.write = exp->write;
+	p->ops.run = plugin_run;
+	p->ops.next_deadline = plugin_deadline;
+	p->ops.show = exp->show;
+	p->next = plugins;
+	plugins = p;
+	dev_register( (char *)exp->name, &p->ops);
+	printf( "plugin %s: device %s\n", filename, exp->name);
+	return 1;
+}
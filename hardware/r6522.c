@@ -31,10 +31,27 @@
 #include <errno.h>
 
 #include <stdlib.h>
+#include <limits.h>
 #include "../emu/config.h"
 #include "../emu/emu6809.h"
 #include "hardware.h"
 
+// interrupt flag and enable bits
+#define VIA_CA2 0x01
+#define VIA_CA1 0x02
+#define VIA_SR 0x04
+#define VIA_CB2 0x08
+#define VIA_CB1 0x10
+#define VIA_T2 0x20
+#define VIA_T1 0x40
+#define VIA_IRQ 0x80
+
+// auxiliary control register
+#define VIA_PB7 0x80		// T1 drives PB7
+#define VIA_FREERUN 0x40	// T1 continuous, else one shot
+#define VIA_PULSES 0x20		// T2 counts PB6 pulses, else one shot
+#define VIA_SRMODE(acr) (((acr) >> 2) & 0x07)
+
 struct Via {
 	uint8_t orb;
 	uint8_t irb;
@@ -42,13 +59,10 @@ struct Via {
 	uint8_t ira;
 	uint8_t ddra;
 	uint8_t ddrb;
-	uint8_t t1c_l;
-	uint8_t t1c_h;
 	uint8_t t1l_l;
 	uint8_t t1l_h;
-	uint8_t t2c_l;
-	uint8_t t2c_h;
-	uint8_t sr;
+	uint8_t t2l_l;
+	uint8_t sr;			// shift register at sr_since
 	uint8_t acr;
 	uint8_t pcr;
 	uint8_t ifr;
@@ -59,93 +73,294 @@ struct Via {
 	int8_t setcb1;
 	int8_t cb2;
 	int8_t setcb2;
+	uint8_t pb7;		// T1 output at t1_since
+	uint8_t t1shot;		// one shot : time out to come
+	uint8_t t2shot;
+	uint8_t pb6;		// PB6 input, counted by T2
+	uint8_t sbits;		// bits left to shift at sr_since
+	uint16_t t2c;		// T2 counter at t2_since
+	int32_t t1left;		// cycles from t1_since to the next T1 time out
+	int64_t t1_since;
+	int64_t t2_since;
+	int64_t sr_since;
+	int64_t t1_due;		// next time out or end of shift, LONG_MAX if none
+	int64_t t2_due;
+	int64_t sr_due;
 };
 
 /*
 	Rockwell 6522 VIA contains two 8 bits parallel ports (PIA),
 	2 counter/timers ans some serial I/O lines
+	The timers and the shift register are not clocked : each keeps its
+	state at the cycle it was loaded, and what it holds later is computed
+	from the cycles elapsed when it is read. Their next time out is known
+	in advance and is the deadline of the device when its interrupt is
+	enabled. T1 reloads from its latches N+2 cycles after each time out,
+	sets its flag at each time out in free run, or at the first one after
+	T1C-H is written in one shot, and toggles PB7 or sets it back high if
+	asked. T2 counts down from T2C-H write and sets its flag at the first
+	time out, or counts the falling edges of PB6 given by r6522_pb6() and
+	sets its flag at zero. The shift register moves a bit every 2 cycles
+	on phi2, every 2*(T2L-L+2) cycles on T2, shifting in the level of CB2
+	or rotating out; the external CB1 clock is not wired.
 */
 
+static void via_irq( struct Via *via) {
+	via->ifr &= 0x7f;
+	if (via->ifr & via->ier & 0x7f)
+	  via->ifr |= VIA_IRQ;
+}
+
+static long via_t1latch( struct Via *via) {
+	return via->t1l_h << 8 | via->t1l_l;
+}
+
+// cycles to the next T1 time out at cycle now, with the time outs passed
+static long via_t1left( struct Via *via, int64_t now, long *timeouts) {
+	long k = now - via->t1_since, period = via_t1latch( via) + 2;
+
+	if (k < via->t1left) {
+	  *timeouts = 0;
+	  return via->t1left - k;
+	}
+	k -= via->t1left;
+	*timeouts = k / period + 1;
+	return period - k % period;
+}
+
+// T1 counter left cycles before its time out : FFFF just after the last one
+static uint16_t via_t1value( struct Via *via, long left) {
+	return left == via_t1latch( via) + 2 ? 0xffff : left - 1;
+}
+
+static int via_pb7( struct Via *via, long timeouts) {
+	if (via->acr & VIA_FREERUN)
+	  return via->pb7 ^ (timeouts & 1);
+	return via->t1shot && timeouts ? 1 : via->pb7;
+}
+
+// T1 goes on from now with the state it has
+static void via_t1rebase( struct Via *via, int64_t now) {
+	long timeouts, left;
+
+	left = via_t1left( via, now, &timeouts);
+	via->pb7 = via_pb7( via, timeouts);
+	if (timeouts)
+	  via->t1shot = 0;
+	via->t1left = left;
+	via->t1_since = now;
+	via->t1_due = (via->acr & VIA_FREERUN) || via->t1shot ? now + left : LONG_MAX;
+}
+
+static uint16_t via_t2value( struct Via *via, int64_t now) {
+	if (via->acr & VIA_PULSES)
+	  return via->t2c;
+	return via->t2c - (now - via->t2_since);
+}
+
+static void via_t2rebase( struct Via *via, int64_t now) {
+	via->t2c = via_t2value( via, now);
+	via->t2_since = now;
+	via->t2_due = via->t2shot && !(via->acr & VIA_PULSES) ? now + via->t2c + 1 : LONG_MAX;
+}
+
+// cycles between two shifts, 0 if not clocked
+static long via_srperiod( struct Via *via) {
+	switch (VIA_SRMODE( via->acr)) {
+	  case 1 : case 4 : case 5 :
+		return 2 * (via->t2l_l + 2L);
+	  case 2 : case 6 :
+		return 2;
+	}
+	return 0;
+}
+
+// shifts done since sr_since
+static long via_shifts( struct Via *via, int64_t now) {
+	long period = via_srperiod( via), n;
+
+	if (period == 0 || via->sbits == 0)
+	  return 0;
+	n = (now - via->sr_since) / period;
+	if (VIA_SRMODE( via->acr) != 4 && n > via->sbits)
+	  n = via->sbits;
+	return n;
+}
+
+static uint8_t via_srvalue( struct Via *via, long n) {
+	if (n == 0)
+	  return via->sr;
+	if (VIA_SRMODE( via->acr) < 4) {	// shift in the level of CB2
+	  if (n >= 8)
+		return via->cb2 ? 0xff : 0;
+	  return via->sr << n | (via->cb2 ? (1 << n) - 1 : 0);
+	}
+	n &= 7;								// rotate out
+	return via->sr << n | via->sr >> (8 - n);
+}
+
+static void via_srrebase( struct Via *via, int64_t now) {
+	long n = via_shifts( via, now), period;
+
+	if (n && VIA_SRMODE( via->acr) >= 4)	// last bit out on CB2
+	  via->cb2 = (via_srvalue( via, n - 1) & 0x80) != 0;
+	via->sr = via_srvalue( via, n);
+	if (VIA_SRMODE( via->acr) != 4)
+	  via->sbits -= n;
+	via->sr_since = now;
+	period = via_srperiod( via);
+	via->sr_due = via->sbits && period && VIA_SRMODE( via->acr) != 4
+		? now + via->sbits * period : LONG_MAX;
+}
+
+// time outs and shifts up to now
+static void via_update( struct Via *via, int64_t now) {
+	int flag;
+
+	if (via->t1_due <= now) {
+	  flag = (via->acr & VIA_FREERUN) || via->t1shot;
+	  via_t1rebase( via, now);
+	  if (flag)
+		via->ifr |= VIA_T1;
+	}
+	if (via->t2_due <= now) {
+	  via->t2shot = 0;
+	  via_t2rebase( via, now);
+	  via->ifr |= VIA_T2;
+	}
+	if (via->sr_due <= now) {
+	  via_srrebase( via, now);
+	  via->ifr |= VIA_SR;
+	}
+	via_irq( via);
+}
+
+// the PB6 input changes, T2 counting its falling edges
+void r6522_pb6( struct Device *dev, int level) {
+	struct Via *via = dev->registers;
+
+	level = level != 0;
+	if (via->pb6 == level)
+	  return;
+	via->pb6 = level;
+	if (level || !(via->acr & VIA_PULSES))
+	  return;
+	via->t2c--;
+	if (via->t2c == 0 && via->t2shot) {
+	  via->t2shot = 0;
+	  via->ifr |= VIA_T2;
+	  via_irq( via);
+	  dev_deadline = 0;
+	}
+}
+
 // Initialisation at reset
 void r6522_reset( struct Device *dev) {
 	struct Via *via;
 	
 	via = dev->registers;
-	via->orb = 0;
-	via->irb = 0;
-	via->ora = 0;
-	via->ira = 0;
-	via->ddrb = 0;
-	via->ddra = 0;
-	via->sr = 0;
-	via->acr = 0;
-	via->pcr = 0;
-	via->ifr = 0;
-	via->ier = 0;
-
-	via->ca2 = 0;
-	via->setca2 =0;
-	via->cb1 = 0;
-	via->setcb1 =0;
-	via->cb2 = 0;
-	via->setcb2 =0;
+	memset( via, 0, sizeof( struct Via));
+	via->pb7 = 1;
+	via->pb6 = 1;
+	via->t1left = 0x10001;		// counters run, but don't interrupt
+	via->t1_since = cycles;
+	via->t2c = 0xffff;
+	via->t2_since = cycles;
+	via->sr_since = cycles;
+	via->t1_due = LONG_MAX;
+	via->t2_due = LONG_MAX;
+	via->sr_due = LONG_MAX;
 }
 
 // Creation of PIA
-void r6522_init( char* name, uint16_t adr, char int_line) {
+void r6522_init( char* name, uint16_t adr, char *args) {
 	struct Device *new;
 	struct Via *via;
 
 	// Create a device and allocate space for data
 	new = mmalloc( sizeof( struct Device));
 	strcpy( new->devname, name);
-	new->type = R6522;
+	new->ops = &r6522_ops;
 	new->addr = adr;
 	new->end = adr+16;
-	new->interrupt = int_line;
+	new->interrupt = read_intline( &args);
 	via = mmalloc( sizeof( struct Via));
 	new->registers = via;
-	new->next = devices;
-	devices = new;
+	dev_add( new);
 	r6522_reset( new);
 }
 
 void r6522_run( struct Device *dev) {
-// Call this every time around the loop
-// Used for generating pulse on CA2 or CB2
-// Pulse width is too large (next instruction exec time)
   struct Via *via;
   via = dev->registers;
+  via_update( via, cycles);
+
+  // An interrupt condition occured
+  if (via->ifr & VIA_IRQ) {
+	switch (dev->interrupt) {
+	  case 'F': firq(); break;
+	  case 'I': irq(); break;
+	  case 'N': nmi();
+	  default: break;
+	}
+  }
 }
 
 // handle reads from PIA registers
 uint8_t r6522_read( struct Device *dev, uint16_t reg) {
   struct Via *via;
+  uint16_t val;
+  uint8_t irb;
+  long timeouts;
   via = dev->registers;
+  via_update( via, cycles);
   switch( reg & 0x0f) {
 	case 0x00 :
-	case 0x0f :
-		return via->irb; // always 0...
+	  via->ifr &= ~(VIA_CB1 | VIA_CB2);
+	  via_irq( via);
+	  irb = (via->orb & via->ddrb) | (via->irb & ~via->ddrb);
+	  if (via->acr & VIA_PB7) {
+		via_t1left( via, cycles, &timeouts);
+		irb = (irb & 0x7f) | via_pb7( via, timeouts) << 7;
+	  }
+	  return irb;
 	case 0x01 :
-	  return via->ira;
+	  via->ifr &= ~(VIA_CA1 | VIA_CA2);
+	  via_irq( via);
+	  // fall through - ORA without handshake
+	case 0x0f :
+	  return (via->ora & via->ddra) | (via->ira & ~via->ddra);
 	case 0x02 :
 	  return via->ddrb;
 	case 0x03 :
 	  return via->ddra;
 	case 0x04 :
-	  return via->t1c_l;
+	  via->ifr &= ~VIA_T1;
+	  via_irq( via);
+	  // fall through - T1 counter
 	case 0x05 :
-	  return via->t1c_h;
+	  val = via_t1value( via, via_t1left( via, cycles, &timeouts));
+	  return (reg & 0x01) ? val >> 8 : val & 0xff;
 	case 0x06 :
 	  return via->t1l_l;
 	case 0x07 :
 	  return via->t1l_h;
 	case 0x08 :
-	  return via->t2c_l;
+	  via->ifr &= ~VIA_T2;
+	  via_irq( via);
+	  return via_t2value( via, cycles) & 0xff;
 	case 0x09 :
-	  return via->t2c_h;
+	  return via_t2value( via, cycles) >> 8;
 	case 0x0a :
-	  return via->sr;
+	  via_srrebase( via, cycles);
+	  via->ifr &= ~VIA_SR;
+	  via_irq( via);
+	  val = via->sr;
+	  if (VIA_SRMODE( via->acr) != 0) {	// 8 more bits
+		via->sbits = 8;
+		via_srrebase( via, cycles);
+	  }
+	  return val;
 	case 0x0b :
 	  return via->acr;
 	case 0x0c :
@@ -153,73 +368,129 @@ uint8_t r6522_read( struct Device *dev, uint16_t reg) {
 	case 0x0d :
 	  return via->ifr;
 	case 0x0e :
-	  return via->ier;
+	  return via->ier | 0x80;
   }
+  return 0xff;
 }
 
 // handle writes to PIA registers
 void r6522_write( struct Device *dev, uint16_t reg, uint8_t val) {
   struct Via *via;
   via = dev->registers;
+  via_update( via, cycles);
   switch( reg & 0x0f) {
 	case 0x00 :
-	case 0x0f :
 	  via->orb = val;
-	  return;
+	  via->ifr &= ~(VIA_CB1 | VIA_CB2);
+	  break;
 	case 0x01 :
-	  via->ira = val;
-	  return;
+	  via->ifr &= ~(VIA_CA1 | VIA_CA2);
+	  // fall through - ORA without handshake
+	case 0x0f :
+	  via->ora = val;
+	  break;
 	case 0x02 :
 	  via->ddrb = val;
-	  return;
+	  break;
 	case 0x03 :
 	  via->ddra = val;
-	  return;
+	  break;
 	case 0x04 :
-	  via->t1c_l = val;
-	  return;
-	case 0x05 :
-	  via->t1c_h = val;
-	  return;
 	case 0x06 :
+	  via_t1rebase( via, cycles);
 	  via->t1l_l = val;
-	  return;
+	  break;
+	case 0x05 :		// load and start T1
+	  via->t1l_h = val;
+	  via->ifr &= ~VIA_T1;
+	  via->t1left = via_t1latch( via) + 1;
+	  via->t1_since = cycles;
+	  via->t1shot = 1;
+	  via->pb7 = 0;
+	  via->t1_due = cycles + via->t1left;
+	  break;
 	case 0x07 :
+	  via_t1rebase( via, cycles);
 	  via->t1l_h = val;
-	  return;
-	case 0x08 :
-	  via->t2c_l = val;
-	  return;
-	case 0x09 :
-	  via->t2c_h = val;
-	  return;
+	  via->ifr &= ~VIA_T1;
+	  break;
+	case 0x08 :		// also the rate of the shifts on T2
+	  via_srrebase( via, cycles);
+	  via->t2l_l = val;
+	  via_srrebase( via, cycles);
+	  break;
+	case 0x09 :		// load and start T2
+	  via->ifr &= ~VIA_T2;
+	  via->t2c = val << 8 | via->t2l_l;
+	  via->t2shot = 1;
+	  via_t2rebase( via, cycles);
+	  break;
 	case 0x0a :
+	  via_srrebase( via, cycles);
+	  via->ifr &= ~VIA_SR;
 	  via->sr = val;
-	  return;
-	case 0x0b :
+	  via->sbits = VIA_SRMODE( via->acr) != 0 ? 8 : 0;
+	  via_srrebase( via, cycles);
+	  break;
+	case 0x0b :		// the timers change of mode from now
+	  via_t1rebase( via, cycles);
+	  via_t2rebase( via, cycles);
+	  via_srrebase( via, cycles);
 	  via->acr = val;
-	  return;
+	  via_t1rebase( via, cycles);
+	  via_t2rebase( via, cycles);
+	  via_srrebase( via, cycles);
+	  break;
 	case 0x0c :
 	  via->pcr = val;
-	  return;
+	  break;
 	case 0x0d :
-	  via->ifr = val;
-	  return;
+	  via->ifr &= ~val;
+	  break;
 	case 0x0e :
-	  via->ier = val;
-	  return;
+	  if (val & 0x80)
+		via->ier |= val & 0x7f;
+	  else
+		via->ier &= ~val;
+	  break;
   }
+  via_irq( via);
 }
 
 void r6522_reg( struct Device *dev) {
   struct Via *via;
+  long timeouts, left;
   via = dev->registers;
+  left = via_t1left( via, cycles, &timeouts);
   printf( "\n           PCR:%02X, DDRA:%02X, ORA:%02X, IRA:%02X, CA2:%02X",
 		via->pcr, via->ddra, via->ora, via->ira, via->ca2);
-  printf( "\n           CRB:%02X, DDRB:%02X, ORB:%02X, IRB:%02X, CB1:%02X, CB2:%02X",
+  printf( "\n           ACR:%02X, DDRB:%02X, ORB:%02X, IRB:%02X, CB1:%02X, CB2:%02X",
 		via->acr, via->ddrb, via->orb, via->irb, via->cb1, via->cb2);
-  printf( "\n           T1C-L:%02X, T1C-H:%02X, T1L-L:%02X, T1L-H:%02X, CB1:%02X, CB2:%02X",
-		via->t1c_l, via->t1c_h, via->t1l_l, via->t1l_h);
-  printf( "\n           T2C-L:%02X, T12-H:%02X, SR:%02X, IFR:%02X, IER:%02X\n",
-		via->t2c_l, via->t2c_h, via->sr, via->ifr, via->ier);
+  printf( "\n           T1C:%04X, T1L:%04X, PB7:%d, T2C:%04X, T2L-L:%02X",
+		via_t1value( via, left), (int)via_t1latch( via),
+		via_pb7( via, timeouts), via_t2value( via, cycles), via->t2l_l);
+  printf( "\n           SR:%02X, IFR:%02X, IER:%02X\n",
+		via_srvalue( via, via_shifts( via, cycles)), via->ifr, via->ier);
 }
+
+// the next time out or end of shift whose interrupt is enabled, or at
+// once while an interrupt condition holds
+long r6522_deadline( struct Device *dev) {
+  struct Via *via;
+  long next = LONG_MAX;
+  via = dev->registers;
+  if (via->ifr & VIA_IRQ)
+	return cycles;
+  if ((via->ier & VIA_T1) && via->t1_due < next)
+	next = via->t1_due;
+  if ((via->ier & VIA_T2) && via->t2_due < next)
+	next = via->t2_due;
+  if ((via->ier & VIA_SR) && via->sr_due < next)
+	next = via->sr_due;
+  return next;
+}
+
+const struct DevOps r6522_ops = {
+	r6522_init, r6522_reset, r6522_read, r6522_write,
+	r6522_run, r6522_deadline, r6522_reg
+};
@@ -59,21 +59,20 @@ void r6532_reset( struct Device *dev) {
 }
 
 // Creation of PIA
-void r6532_init( char* name, uint16_t adr, char int_line) {
+void r6532_init( char* name, uint16_t adr, char *args) {
 	struct Device *new;
 	struct Riot *riot;
 
 	// Create a device and allocate space for data
 	new = mmalloc( sizeof( struct Device));
 	strcpy( new->devname, name);
-	new->type = R6532;
+	new->ops = &r6532_ops;
 	new->addr = adr;
 	new->end = adr+160;
-	new->interrupt = int_line;
+	new->interrupt = read_intline( &args);
 	riot = mmalloc( sizeof( struct Riot));
 	new->registers = riot;
-	new->next = devices;
-	devices = new;
+	dev_add( new);
 	r6532_reset( new);
 }
 
@@ -165,3 +164,8 @@ void r6532_reg( struct Device *dev) {
   printf( "\n           TIMER:%02X [/%dT], IFR:%02X, EDC:%02X, interrupt : %s\n",
 		riot->timer, tdiv[riot->settings & 0x03], riot->ifr, riot->edc, iset);
 }
+
+const struct DevOps r6532_ops = {
+	r6532_init, r6532_reset, r6532_read, r6532_write,
+	NULL, NULL, r6532_reg
+};
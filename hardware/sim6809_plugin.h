@@ -0,0 +1,91 @@
+/* vim: set noexpandtab ai ts=4 sw=4 tw=4: */
+/* sim6809_plugin.h -- interface of the loadable device plugins
+   Copyright (C) 2021 Michel J Wurtz
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * A plugin is a shared object exporting a struct sim6809_plugin named
+ * sim6809_plugin. It is loaded from .sim6809.ini, its name then being
+ * used as a device keyword :
+ *     plugin ./mydev.so        # defines device "mydev"
+ *     mydev E0A0 IRQ 4 fast    # device @ 0xe0a0, the rest goes to create()
+ * Build it with: cc -shared -fPIC -o mydev.so mydev.c
+ *
+ * The functions of a plugin take the place of those of a device type :
+ * they get the simulator's struct Device, which begins with the struct
+ * sim6809_device given by SIM6809_DEV(). read() and write() are called
+ * directly by the memory accesses of the cpu, with the absolute address,
+ * reset() at creation and on the console command 'x'. A plugin asks to be
+ * called back at a given cycle through host->schedule().
+ * host->set_interrupt( dev, 1) raises its interrupt line, which stays up
+ * until host->set_interrupt( dev, 0), usually as the status is read : the
+ * interrupt is taken after each instruction meanwhile, unless the cpu
+ * masks it.
+ *
+ * Only this file is part of the interface. SIM6809_PLUGIN_ABI changes when
+ * a structure below changes in an incompatible way, new members being only
+ * added at the end of the structures.
+ */
+
+#ifndef SIM6809_PLUGIN_H
+#define SIM6809_PLUGIN_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SIM6809_PLUGIN_ABI 4
+#define SIM6809_PLUGIN_SYMBOL "sim6809_plugin"
+
+// Public part of a device, beginning of the simulator's struct Device
+struct sim6809_device {
+	void *state;		// private data of the plugin, set by create()
+	uint16_t addr;		// first address of the device
+	uint16_t end;		// last address + 1, set by create() (default addr+1)
+	char interrupt;		// 'I' (IRQ), 'F' (FIRQ), 'N' (NMI) or 'X' (none)
+};
+
+struct Device;		// the simulator's device, beginning as above
+#define SIM6809_DEV( dev) ((struct sim6809_device *)(dev))
+
+// Services of the simulator
+struct sim6809_host {
+	uint32_t abi;
+	int64_t (*cycles)( void);		// cpu cycles since start
+	// call back the device at this cycle, replacing the previous request
+	void (*schedule)( struct Device *dev, int64_t cycle);
+	void (*cancel)( struct Device *dev);
+	// level of the interrupt line, held until set back to 0
+	void (*set_interrupt)( struct Device *dev, int level);
+	uint8_t (*mem_read)( uint16_t adr);
+	void (*mem_write)( uint16_t adr, uint8_t val);
+};
+
+// Exported by the plugin, only create, read and write are mandatory
+struct sim6809_plugin {
+	uint32_t abi;			// SIM6809_PLUGIN_ABI
+	const char *name;		// device keyword in .sim6809.ini
+	// args is the config line after the interrupt line, returns 0 on error
+	int (*create)( struct Device *dev, const struct sim6809_host *host,
+			const char *args);
+	void (*reset)( struct Device *dev);
+	uint8_t (*read)( struct Device *dev, uint16_t adr);
+	void (*write)( struct Device *dev, uint16_t adr, uint8_t val);
+	void (*callback)( struct Device *dev, int64_t cycle);
+	void (*show)( struct Device *dev);
+};
+
+#endif